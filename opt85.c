@@ -1,52 +1,134 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <setjmp.h>
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include "opt85.h"
+
+/* The library keeps the working state of each thread apart so threads
+   can optimize at the same time. The tool runs one file at a time */
+#ifdef OPT85_LIB
+#define PERTHREAD	_Thread_local
+#else
+#define PERTHREAD
+#endif
 
 struct label {
 	struct label *next;
-	struct instruction *instruction;
-	const char *name;
+	unsigned int instruction;
+	const char *name;	/* Points into the input, not terminated */
+	unsigned int namelen;
 	int16_t spbias;
+	uint16_t sym;		/* Interned name */
+	uint8_t entry;		/* Can be reached from code we can't see */
 };
 
-struct effect {
-	struct instruction *prev, *next;
-	uint32_t need, set;
-	uint16_t value[9];	/* X A B C D E H L PSW */
-	/* We can do ranges and more later */
-#define VALUE_KNOWN	0x0100
-	uint32_t flags;
-#define HL_SPBIAS	1	/* Tracking DAD SP */
-	int spbias;		/* Tracked SP bias versus HL */
+/*
+ *	What we know about an 8bit register. Bits may be known to be zero or
+ *	one and the value may be known to lie in an unsigned range. The
+ *	register is fully known when every bit is. Both halves are kept
+ *	consistent by bits_normalise().
+ */
+struct regbits {
+	uint8_t zero;
+	uint8_t one;
+	uint8_t lo;
+	uint8_t hi;
 };
 
-struct instruction {
-	struct effect *prev, *next;
-	struct label *lnext;
-	struct label *label;
-	const char *op;
-	const char *opcode;
-	struct optab *opinfo;
-	const char *insn;
-	uint8_t sr, dr;
-	int addrconst;
-	int spbias;
-	int dead;
-	uint32_t set;		/* Local copies not changed when we */
-	uint32_t need;		/* propagate needs */
+/*
+ *	A register that isn't numerically known may hold half of a symbol
+ *	plus an offset. This is how ack builds almost every address.
+ */
+struct regsym {
+	uint16_t sym;		/* 0 if not symbolic */
+	uint16_t off;		/* 16bit offset from the symbol */
+	uint8_t high;		/* We hold the high byte */
+};
+
+/*
+ *	The IR is a set of parallel arrays indexed by instruction number so
+ *	that the passes scan contiguous memory. Slot 0 is the entry to the
+ *	code and the head of a circular chain of the live instructions.
+ *	Deleted instructions are left behind as tombstones and new ones are
+ *	added at the end and linked in. ir_compact() puts everything back in
+ *	program order between passes.
+ *
+ *	Each instruction also owns the program point after it, which holds
+ *	what we know about the machine at that point. The point before an
+ *	instruction is the one belonging to the previous live instruction,
+ *	or slot 0 for the first.
+ */
+struct ir {
+	unsigned int count;
+	unsigned int size;
+	/* Per instruction */
+	uint8_t *opcode;	/* Index into ops[] */
+	uint8_t *sr, *dr;
+	uint8_t *dead;
+	int32_t *addrconst;
+	uint16_t *sym;		/* Symbolic operand if any */
+	uint16_t *symoff;	/* and the offset from it */
+	int32_t *spbias;
+	uint32_t *iset;		/* Local copies not changed when we */
+	uint32_t *ineed;	/* propagate needs */
+	const char **op;	/* Points into the input, not terminated */
+	uint32_t *oplen;
+	struct label **label;
+	struct label **target;	/* Label we branch to if it is ours */
+	uint32_t *next, *prev;
+	/* Per program point */
+	uint32_t *need, *set;
+	struct regbits (*bits)[8];	/* X A B C D E H L */
+	struct regsym (*syms)[8];
+	uint32_t (*vn)[8];	/* Value number held by each register */
+	uint32_t (*tos)[2];	/* Value numbers of the pair on the stack top */
+	uint8_t *fknown;	/* Flags we know */
+	uint8_t *fvalue;	/* and their values */
+	uint8_t *flags;
+#define HL_SPBIAS	1	/* Tracking DAD SP */
+	int32_t *hlbias;	/* Tracked SP bias versus HL */
 };
 
-#define BIAS_UNKNOWN 0xFFFF0000
-#define CONST_UNKNOWN 0xFFFF0000
+#define IR_FIELDS \
+	X(opcode) X(sr) X(dr) X(dead) X(addrconst) X(sym) X(symoff) \
+	X(spbias) X(iset) X(ineed) X(op) X(oplen) X(label) X(target) \
+	X(next) X(prev) \
+	X(need) X(set) X(bits) X(syms) X(vn) X(tos) X(fknown) X(fvalue) \
+	X(flags) X(hlbias)
+
+#define OPINFO(i)	(ops + ir.opcode[i])
 
-struct instruction *codehead, *codetail;
-unsigned int linenum;
-int spbias;
+#define BIAS_UNKNOWN ((int32_t)0xFFFF0000)
+#define CONST_UNKNOWN ((int32_t)0xFFFF0000)
 
-static struct effect dummy_effect;
+static PERTHREAD struct ir ir;
+static PERTHREAD unsigned int linenum;
+static PERTHREAD int spbias;
+
+/*
+ *	All of the per file data is allocated from an arena so that batch
+ *	mode can throw a whole file away and reuse the memory for the next
+ *	one without going back to malloc.
+ */
+struct arena {
+	struct arena *next;
+	size_t size;
+	size_t used;
+};
+
+#define ARENA_CHUNK	65536
+
+static PERTHREAD struct arena *arena_head, *arena_cur;
 
 struct optab {
 	const char *op;
@@ -67,10 +149,53 @@ struct optab {
 #define OP_PAIRMOD	8192	/* Ditto for an RP, can't be M */
 #define OP_RET		16384	/* Returns */
 #define OP_KEEP		32768	/* Side effects */
+#define OP_PSEUDO	65536	/* Assembler directive, passed through */
+#define OP_DATA		131072	/* Directive that places bytes or moves */
+#define OP_OFF8		262144	/* 8bit offset added to a pair */
+#define OP_8085		524288	/* Undocumented 8085 only */
+#define OP_Z80		1048576	/* Z80 only */
 
 	uint16_t imask, omask;
+	uint8_t alu;		/* ALU operation for constant evaluation */
+	uint8_t bytes;		/* Size */
+	uint8_t cycles;		/* T-states, taken for conditionals. These are
+				   the 8085 ones until the target changes them */
 };
 
+/* ALU operations we know how to evaluate */
+#define ALU_ADD		1
+#define ALU_ADC		2
+#define ALU_SUB		3
+#define ALU_SBB		4
+#define ALU_AND		5
+#define ALU_XOR		6
+#define ALU_OR		7
+#define ALU_CMP		8
+#define ALU_INR		9
+#define ALU_DCR		10
+#define ALU_RLC		11
+#define ALU_RRC		12
+#define ALU_RAL		13
+#define ALU_RAR		14
+#define ALU_CMA		15
+#define ALU_DAA		16
+#define ALU_STC		17
+#define ALU_CMC		18
+#define ALU_INX		19	/* 16bit from here on */
+#define ALU_DCX		20
+#define ALU_DAD		21
+#define ALU_DSUB	22	/* Undocumented 8085 */
+#define ALU_ARHL	23
+#define ALU_RDEL	24
+
+/* The flags as they sit in PSW */
+#define FLAG_S		0x80
+#define FLAG_Z		0x40
+#define FLAG_AC		0x10
+#define FLAG_P		0x04
+#define FLAG_CY		0x01
+#define FLAG_ALL	(FLAG_S | FLAG_Z | FLAG_AC | FLAG_P | FLAG_CY)
+
 /* A-L must be 1-8 for value mask */
 #define REG_A		1
 #define REG_B		2
@@ -112,1136 +237,6829 @@ struct optab {
 
 struct optab ops[] = {
 	/* For these the immediate form *MUST* follow the non immediate */
-	{ "MOV", OP_MOV, 0, 0 },
-	{ "MVI", OP_MVI, 0, 0 },
-	{ "LXI", OP_DPAIR | OP_IMMED, 0, 0 },
-	{ "LDA", OP_ADDR, MEMORYM, REGM_A },
-	{ "STA", OP_ADDR, REGM_A, MEMORYM },
-	{ "LHLD", OP_ADDR, MEMORYM, REGM_H | REGM_L },
-	{ "SHLD", OP_ADDR, REGM_H | REGM_L, MEMORYM },
-	{ "LDAX", OP_ADDR | OP_SPAIR, MEMORYM, REGM_A },
-	{ "STAX", OP_ADDR | OP_DPAIR, REGM_A, MEMORYM },
+	{ "MOV", OP_MOV, 0, 0, 0, 1, 4 },
+	{ "MVI", OP_MVI, 0, 0, 0, 2, 7 },
+	{ "LXI", OP_DPAIR | OP_IMMED, 0, 0, 0, 3, 10 },
+	{ "LDA", OP_ADDR, MEMORYM, REGM_A, 0, 3, 13 },
+	{ "STA", OP_ADDR, REGM_A, MEMORYM, 0, 3, 13 },
+	{ "LHLD", OP_ADDR, MEMORYM, REGM_H | REGM_L, 0, 3, 16 },
+	{ "SHLD", OP_ADDR, REGM_H | REGM_L, MEMORYM, 0, 3, 16 },
+	{ "LDAX", OP_ADDR | OP_SPAIR, MEMORYM, REGM_A, 0, 1, 7 },
+	{ "STAX", OP_ADDR | OP_SPAIR, REGM_A, MEMORYM, 0, 1, 7 },
 	/* Really xchg swaps over the properties - we should do likewise eventually */
 	{ "XCHG", 0, REGM_D | REGM_E | REGM_H | REGM_L,
-	 REGM_D | REGM_E | REGM_H | REGM_L },
-	{ "INR", OP_REGMOD, 0, 0 },
-	{ "DCR", OP_REGMOD, 0, 0 },
-	{ "INX", OP_PAIRMOD, 0, 0 },
-	{ "DEX", OP_PAIRMOD, 0, 0 },
-	{ "DAD", OP_SPAIR, REGM_H | REGM_L, REGM_H | REGM_L | REGM_PSW },
-	{ "DAA", 0, REGM_A | REGM_PSW, REGM_A | REGM_PSW },
-	{ "RLC", 0, REGM_A | REGM_PSW, REGM_A | REGM_PSW },
-	{ "RRC", 0, REGM_A | REGM_PSW, REGM_A | REGM_PSW },
-	{ "RAL", 0, REGM_A | REGM_PSW, REGM_A | REGM_PSW },
-	{ "RAR", 0, REGM_A | REGM_PSW, REGM_A | REGM_PSW },
-	{ "CMA", 0, REGM_A | REGM_PSW, REGM_A | REGM_PSW },
-	{ "CMC", 0, REGM_PSW, REGM_PSW },
-	{ "STC", 0, REGM_PSW, REGM_PSW },
+	 REGM_D | REGM_E | REGM_H | REGM_L, 0, 1, 4 },
+	{ "INR", OP_REGMOD, 0, REGM_PSW, ALU_INR, 1, 4 },
+	{ "DCR", OP_REGMOD, 0, REGM_PSW, ALU_DCR, 1, 4 },
+	{ "INX", OP_PAIRMOD, 0, 0, ALU_INX, 1, 6 },
+	{ "DEX", OP_PAIRMOD, 0, 0, ALU_DCX, 1, 6 },
+	{ "DCX", OP_PAIRMOD, 0, 0, ALU_DCX, 1, 6 },
+	{ "DAD", OP_SPAIR, REGM_H | REGM_L, REGM_H | REGM_L | REGM_PSW, ALU_DAD, 1, 10 },
+	{ "DAA", 0, REGM_A | REGM_PSW, REGM_A | REGM_PSW, ALU_DAA, 1, 4 },
+	{ "RLC", 0, REGM_A, REGM_A | REGM_PSW, ALU_RLC, 1, 4 },
+	{ "RRC", 0, REGM_A, REGM_A | REGM_PSW, ALU_RRC, 1, 4 },
+	{ "RAL", 0, REGM_A | REGM_PSW, REGM_A | REGM_PSW, ALU_RAL, 1, 4 },
+	{ "RAR", 0, REGM_A | REGM_PSW, REGM_A | REGM_PSW, ALU_RAR, 1, 4 },
+	{ "CMA", 0, REGM_A, REGM_A, ALU_CMA, 1, 4 },
+	{ "CMC", 0, REGM_PSW, REGM_PSW, ALU_CMC, 1, 4 },
+	{ "STC", 0, 0, REGM_PSW, ALU_STC, 1, 4 },
 	/* For these the immediate form *MUST* follow the non immediate */
-	{ "ADD", OP_AOP, REGM_A, REGM_A | REGM_PSW },
-	{ "ADI", OP_AOP | OP_IMMED, REGM_A, REGM_A | REGM_PSW },
-	{ "ADC", OP_AOP | OP_C, REGM_A | REGM_PSW, REGM_A | REGM_PSW },
-	{ "ACI", OP_AOP | OP_IMMED, REGM_A | REGM_PSW, REGM_A | REGM_PSW },
-	{ "SUB", OP_AOP, REGM_A, REGM_A | REGM_PSW },
-	{ "SUI", OP_AOP | OP_IMMED, REGM_A, REGM_A | REGM_PSW },
-	{ "SBC", OP_AOP | OP_C, REGM_A | REGM_PSW, REGM_A | REGM_PSW },
-	{ "SBI", OP_AOP | OP_IMMED, REGM_A | REGM_PSW, REGM_A | REGM_PSW },
-	{ "ANA", OP_AOP, REGM_A, REGM_A | REGM_PSW },
-	{ "ANI", OP_AOP | OP_IMMED, REGM_A, REGM_A | REGM_PSW },
-	{ "ORA", OP_AOP, REGM_A, REGM_A | REGM_PSW },
-	{ "ORI", OP_AOP | OP_IMMED, REGM_A, REGM_A | REGM_PSW },
-	{ "XRA", OP_AOP, REGM_A, REGM_A | REGM_PSW },
-	{ "XRI", OP_AOP | OP_IMMED, REGM_A, REGM_A | REGM_PSW },
-	{ "CMP", OP_AOP, REGM_A, REGM_A | REGM_PSW },
-	{ "CPI", OP_AOP | OP_IMMED, REGM_A, REGM_A | REGM_PSW },
+	{ "ADD", OP_AOP, REGM_A, REGM_A | REGM_PSW, ALU_ADD, 1, 4 },
+	{ "ADI", OP_AOP | OP_IMMED, REGM_A, REGM_A | REGM_PSW, ALU_ADD, 2, 7 },
+	{ "ADC", OP_AOP | OP_C, REGM_A | REGM_PSW, REGM_A | REGM_PSW, ALU_ADC, 1, 4 },
+	{ "ACI", OP_AOP | OP_IMMED | OP_C, REGM_A | REGM_PSW, REGM_A | REGM_PSW, ALU_ADC, 2, 7 },
+	{ "SUB", OP_AOP, REGM_A, REGM_A | REGM_PSW, ALU_SUB, 1, 4 },
+	{ "SUI", OP_AOP | OP_IMMED, REGM_A, REGM_A | REGM_PSW, ALU_SUB, 2, 7 },
+	{ "SBB", OP_AOP | OP_C, REGM_A | REGM_PSW, REGM_A | REGM_PSW, ALU_SBB, 1, 4 },
+	{ "SBI", OP_AOP | OP_IMMED | OP_C, REGM_A | REGM_PSW, REGM_A | REGM_PSW, ALU_SBB, 2, 7 },
+	{ "ANA", OP_AOP, REGM_A, REGM_A | REGM_PSW, ALU_AND, 1, 4 },
+	{ "ANI", OP_AOP | OP_IMMED, REGM_A, REGM_A | REGM_PSW, ALU_AND, 2, 7 },
+	{ "ORA", OP_AOP, REGM_A, REGM_A | REGM_PSW, ALU_OR, 1, 4 },
+	{ "ORI", OP_AOP | OP_IMMED, REGM_A, REGM_A | REGM_PSW, ALU_OR, 2, 7 },
+	{ "XRA", OP_AOP, REGM_A, REGM_A | REGM_PSW, ALU_XOR, 1, 4 },
+	{ "XRI", OP_AOP | OP_IMMED, REGM_A, REGM_A | REGM_PSW, ALU_XOR, 2, 7 },
+	{ "CMP", OP_AOP, REGM_A, REGM_PSW, ALU_CMP, 1, 4 },
+	{ "CPI", OP_AOP | OP_IMMED, REGM_A, REGM_PSW, ALU_CMP, 2, 7 },
 	/* Assume the worst case for branches for now. We can do better later
 	   for single target forward jumps from the compiler */
-	{ "JMP", OP_BRA, REGM_ALL, 0 },
-	{ "JZ", OP_BRA, REGM_ALL, 0 },
-	{ "JNZ", OP_BRA, REGM_ALL, 0 },
-	{ "JC", OP_BRA, REGM_ALL, 0 },
-	{ "JNC", OP_BRA, REGM_ALL, 0 },
-	{ "JP", OP_BRA, REGM_ALL, 0 },
-	{ "JM", OP_BRA, REGM_ALL, 0 },
-	{ "JPO", OP_BRA, REGM_ALL, 0 },
-	{ "JPE", OP_BRA, REGM_ALL, 0 },
-	{ "PCHL", OP_BRA, REGM_ALL, 0 },
+	{ "JMP", OP_BRA, REGM_ALL, 0, 0, 3, 10 },
+	{ "JZ", OP_BRA, REGM_ALL, 0, 0, 3, 10 },
+	{ "JNZ", OP_BRA, REGM_ALL, 0, 0, 3, 10 },
+	{ "JC", OP_BRA, REGM_ALL, 0, 0, 3, 10 },
+	{ "JNC", OP_BRA, REGM_ALL, 0, 0, 3, 10 },
+	{ "JP", OP_BRA, REGM_ALL, 0, 0, 3, 10 },
+	{ "JM", OP_BRA, REGM_ALL, 0, 0, 3, 10 },
+	{ "JPO", OP_BRA, REGM_ALL, 0, 0, 3, 10 },
+	{ "JPE", OP_BRA, REGM_ALL, 0, 0, 3, 10 },
+	{ "PCHL", OP_BRA, REGM_ALL, 0, 0, 1, 6 },
 	/* Returns need DEHL and SP right */
-	{ "RET", OP_RET, REGM_SP | REGM_RETS, REGM_SP },
-	{ "RZ", OP_RET, REGM_PSW | REGM_SP | REGM_RETS, REGM_SP },
-	{ "RNZ", OP_RET, REGM_PSW | REGM_SP | REGM_RETS, REGM_SP },
-	{ "RC", OP_RET, REGM_PSW | REGM_SP | REGM_RETS, REGM_SP },
-	{ "RNC", OP_RET, REGM_PSW | REGM_SP | REGM_RETS, REGM_SP },
-	{ "RP", OP_RET, REGM_PSW | REGM_SP | REGM_RETS, REGM_SP },
-	{ "RM", OP_RET, REGM_PSW | REGM_SP | REGM_RETS, REGM_SP },
-	{ "RPO", OP_RET, REGM_PSW | REGM_SP | REGM_RETS, REGM_SP },
-	{ "RPE", OP_RET, REGM_PSW | REGM_SP | REGM_RETS, REGM_SP },
+	{ "RET", OP_RET, REGM_SP | REGM_RETS, REGM_SP, 0, 1, 10 },
+	{ "RZ", OP_RET, REGM_PSW | REGM_SP | REGM_RETS, REGM_SP, 0, 1, 12 },
+	{ "RNZ", OP_RET, REGM_PSW | REGM_SP | REGM_RETS, REGM_SP, 0, 1, 12 },
+	{ "RC", OP_RET, REGM_PSW | REGM_SP | REGM_RETS, REGM_SP, 0, 1, 12 },
+	{ "RNC", OP_RET, REGM_PSW | REGM_SP | REGM_RETS, REGM_SP, 0, 1, 12 },
+	{ "RP", OP_RET, REGM_PSW | REGM_SP | REGM_RETS, REGM_SP, 0, 1, 12 },
+	{ "RM", OP_RET, REGM_PSW | REGM_SP | REGM_RETS, REGM_SP, 0, 1, 12 },
+	{ "RPO", OP_RET, REGM_PSW | REGM_SP | REGM_RETS, REGM_SP, 0, 1, 12 },
+	{ "RPE", OP_RET, REGM_PSW | REGM_SP | REGM_RETS, REGM_SP, 0, 1, 12 },
 	/* Calls need everything - needs review to see if we can spot the
 	   special functions versus C calls that need nothing sane */
-	{ "CALL", OP_CALL, REGM_ALL, REGM_ALL },
-	{ "CZ", OP_CALL, REGM_ALL, REGM_ALL },
-	{ "CNZ", OP_CALL, REGM_ALL, REGM_ALL },
-	{ "CC", OP_CALL, REGM_ALL, REGM_ALL },
-	{ "CNC", OP_CALL, REGM_ALL, REGM_ALL },
-	{ "CP", OP_CALL, REGM_ALL, REGM_ALL },
-	{ "CM", OP_CALL, REGM_ALL, REGM_ALL },
-	{ "CPO", OP_CALL, REGM_ALL, REGM_ALL },
-	{ "CPE", OP_CALL, REGM_ALL, REGM_ALL },
+	{ "CALL", OP_CALL, REGM_ALL, REGM_ALL, 0, 3, 18 },
+	{ "CZ", OP_CALL, REGM_ALL, REGM_ALL, 0, 3, 18 },
+	{ "CNZ", OP_CALL, REGM_ALL, REGM_ALL, 0, 3, 18 },
+	{ "CC", OP_CALL, REGM_ALL, REGM_ALL, 0, 3, 18 },
+	{ "CNC", OP_CALL, REGM_ALL, REGM_ALL, 0, 3, 18 },
+	{ "CP", OP_CALL, REGM_ALL, REGM_ALL, 0, 3, 18 },
+	{ "CM", OP_CALL, REGM_ALL, REGM_ALL, 0, 3, 18 },
+	{ "CPO", OP_CALL, REGM_ALL, REGM_ALL, 0, 3, 18 },
+	{ "CPE", OP_CALL, REGM_ALL, REGM_ALL, 0, 3, 18 },
 	/* Need to add smarts for compiler stubs */
-	{ "RST", OP_CALL, REGM_ALL, REGM_ALL },
-	{ "PUSH", OP_SPAIR, REGM_SP, REGM_SP | MEMORYM },
-	{ "POP", OP_DPAIR, REGM_SP | MEMORYM, REGM_SP },
+	{ "RST", OP_CALL, REGM_ALL, REGM_ALL, 0, 1, 12 },
+	{ "PUSH", OP_SPAIR, REGM_SP, REGM_SP | MEMORYM, 0, 1, 12 },
+	{ "POP", OP_DPAIR, REGM_SP | MEMORYM, REGM_SP, 0, 1, 10 },
 	{ "XTHL", 0, MEMORYM | REGM_SP | REGM_H | REGM_L,
-	 MEMORYM | REGM_H | REGM_L },
-	{ "SPHL", 0, REGM_H | REGM_L, REGM_SP },
-	{ "IN", OP_KEEP, 0, REGM_A },
-	{ "OUT", OP_KEEP, REGM_A, 0 },
-	{ "EI", OP_KEEP, 0, SIDEEFFECTM },
-	{ "DI", OP_KEEP, 0, SIDEEFFECTM },
-	{ "HLT", OP_KEEP, 0, SIDEEFFECTM },
-	{ "NOP", 0, 0, 0 },
+	 MEMORYM | REGM_H | REGM_L, 0, 1, 16 },
+	{ "SPHL", 0, REGM_H | REGM_L, REGM_SP, 0, 1, 6 },
+	/* Undocumented 8085 instructions */
+	{ "DSUB", OP_8085, REGM_B | REGM_C | REGM_H | REGM_L,
+	 REGM_H | REGM_L | REGM_PSW, ALU_DSUB, 1, 10 },
+	{ "ARHL", OP_8085, REGM_H | REGM_L, REGM_H | REGM_L | REGM_PSW,
+	 ALU_ARHL, 1, 7 },
+	{ "RDEL", OP_8085, REGM_D | REGM_E | REGM_PSW,
+	 REGM_D | REGM_E | REGM_PSW, ALU_RDEL, 1, 10 },
+	{ "LDHI", OP_8085 | OP_OFF8, REGM_H | REGM_L, REGM_D | REGM_E, 0, 2, 10 },
+	{ "LDSI", OP_8085 | OP_OFF8, REGM_SP, REGM_D | REGM_E, 0, 2, 10 },
+	{ "LHLX", OP_8085, REGM_D | REGM_E | MEMORYM, REGM_H | REGM_L, 0, 1, 10 },
+	{ "SHLX", OP_8085, REGM_D | REGM_E | REGM_H | REGM_L, MEMORYM, 0, 1, 10 },
+	{ "JK", OP_8085 | OP_BRA, REGM_ALL, 0, 0, 3, 10 },
+	{ "JNK", OP_8085 | OP_BRA, REGM_ALL, 0, 0, 3, 10 },
+	/* Z80 relative branches, in the Intel style spelling */
+	{ "JR", OP_Z80 | OP_BRA, REGM_ALL, 0, 0, 2, 12 },
+	{ "JRZ", OP_Z80 | OP_BRA, REGM_ALL, 0, 0, 2, 12 },
+	{ "JRNZ", OP_Z80 | OP_BRA, REGM_ALL, 0, 0, 2, 12 },
+	{ "JRC", OP_Z80 | OP_BRA, REGM_ALL, 0, 0, 2, 12 },
+	{ "JRNC", OP_Z80 | OP_BRA, REGM_ALL, 0, 0, 2, 12 },
+	{ "DJNZ", OP_Z80 | OP_BRA, REGM_ALL, REGM_B, 0, 2, 13 },
+	{ "IN", OP_KEEP, 0, REGM_A, 0, 2, 10 },
+	{ "OUT", OP_KEEP, REGM_A, 0, 0, 2, 10 },
+	{ "EI", OP_KEEP, 0, SIDEEFFECTM, 0, 1, 4 },
+	{ "DI", OP_KEEP, 0, SIDEEFFECTM, 0, 1, 4 },
+	{ "HLT", OP_KEEP, 0, SIDEEFFECTM, 0, 1, 5 },
+	{ "NOP", 0, 0, 0, 0, 1, 4 },
+	/* Assembler directives. A label on its own is an empty one */
+	{ "", OP_PSEUDO, 0, SIDEEFFECTM, 0, 0, 0 },
+	{ ".define", OP_PSEUDO, 0, SIDEEFFECTM, 0, 0, 0 },
+	{ ".extern", OP_PSEUDO, 0, SIDEEFFECTM, 0, 0, 0 },
+	{ ".comm", OP_PSEUDO, 0, SIDEEFFECTM, 0, 0, 0 },
+	{ ".line", OP_PSEUDO, 0, SIDEEFFECTM, 0, 0, 0 },
+	{ ".file", OP_PSEUDO, 0, SIDEEFFECTM, 0, 0, 0 },
+	{ ".symb", OP_PSEUDO, 0, SIDEEFFECTM, 0, 0, 0 },
+	/* Code can't flow through these. "." is any we don't know */
+	{ ".sect", OP_PSEUDO | OP_DATA, REGM_ALL, SIDEEFFECTM, 0, 0, 0 },
+	{ ".base", OP_PSEUDO | OP_DATA, REGM_ALL, SIDEEFFECTM, 0, 0, 0 },
+	{ ".data1", OP_PSEUDO | OP_DATA, REGM_ALL, SIDEEFFECTM, 0, 0, 0 },
+	{ ".data2", OP_PSEUDO | OP_DATA, REGM_ALL, SIDEEFFECTM, 0, 0, 0 },
+	{ ".data4", OP_PSEUDO | OP_DATA, REGM_ALL, SIDEEFFECTM, 0, 0, 0 },
+	{ ".ascii", OP_PSEUDO | OP_DATA, REGM_ALL, SIDEEFFECTM, 0, 0, 0 },
+	{ ".asciz", OP_PSEUDO | OP_DATA, REGM_ALL, SIDEEFFECTM, 0, 0, 0 },
+	{ ".space", OP_PSEUDO | OP_DATA, REGM_ALL, SIDEEFFECTM, 0, 0, 0 },
+	{ ".align", OP_PSEUDO | OP_DATA, REGM_ALL, SIDEEFFECTM, 0, 0, 0 },
+	{ ".", OP_PSEUDO | OP_DATA, REGM_ALL, SIDEEFFECTM, 0, 0, 0 },
 	{ NULL, }
 };
 
-static struct optab *find_operation(const char *p)
+/*
+ *	Operation lookup. This is done for every line so we hash the table
+ *	once at start up and keep it for every file we process.
+ */
+#define OPHASH_SIZE	256
+
+static PERTHREAD struct optab *ophash[OPHASH_SIZE];
+static PERTHREAD int ops_ready;
+
+static unsigned int hash_op(const char *p)
+{
+	unsigned int h = 0;
+	while (*p)
+		h = h * 31 + toupper(*p++);
+	return h & (OPHASH_SIZE - 1);
+}
+
+/* Each thread builds its own on the first call it makes */
+static void init_ops(void)
 {
 	struct optab *o = ops;
+	if (ops_ready)
+		return;
+	ops_ready = 1;
 	while (o->op) {
-		if (strcasecmp(o->op, p) == 0)
-			return o;
+		unsigned int h = hash_op(o->op);
+		while (ophash[h])
+			h = (h + 1) & (OPHASH_SIZE - 1);
+		ophash[h] = o;
 		o++;
 	}
-	return NULL;
 }
 
-static void *zalloc(size_t size)
+static struct optab *find_operation(const char *p)
 {
-	void *p = malloc(size);
-	if (p == NULL) {
-		fprintf(stderr, "Out of memory allocating %lu bytes.\n",
-			(unsigned long) size);
-		exit(1);
+	unsigned int h = hash_op(p);
+	while (ophash[h]) {
+		if (strcasecmp(ophash[h]->op, p) == 0)
+			return ophash[h];
+		h = (h + 1) & (OPHASH_SIZE - 1);
 	}
-	memset(p, 0, size);
-	return p;
+	return NULL;
 }
 
-static void error(const char *p)
+/*
+ *	CPU targets. Each picks the extra instructions we may use, patches
+ *	in its own timings and says where its flags differ from the 8085
+ *	ones we evaluate.
+ */
+#define FD_ANA_AC	1	/* AC after ANA is the 8080 one */
+#define FD_Z80		2	/* P is overflow after arithmetic, rotates
+				   and the like change AC */
+
+struct opcycles {
+	const char *op;
+	uint8_t cycles;
+};
+
+static const struct opcycles cycles_8080[] = {
+	{ "MOV", 5 }, { "INR", 5 }, { "DCR", 5 }, { "INX", 5 }, { "DEX", 5 },
+	{ "DCX", 5 }, { "PCHL", 5 }, { "SPHL", 5 }, { "XTHL", 18 },
+	{ "PUSH", 11 }, { "RST", 11 }, { "HLT", 7 },
+	{ "CALL", 17 }, { "CZ", 17 }, { "CNZ", 17 }, { "CC", 17 }, { "CNC", 17 },
+	{ "CP", 17 }, { "CM", 17 }, { "CPO", 17 }, { "CPE", 17 },
+	{ "RZ", 11 }, { "RNZ", 11 }, { "RC", 11 }, { "RNC", 11 },
+	{ "RP", 11 }, { "RM", 11 }, { "RPO", 11 }, { "RPE", 11 },
+	{ NULL, }
+};
+
+static const struct opcycles cycles_z80[] = {
+	{ "DAD", 11 }, { "PCHL", 4 }, { "XTHL", 19 }, { "PUSH", 11 },
+	{ "RST", 11 }, { "IN", 11 }, { "OUT", 11 }, { "HLT", 4 },
+	{ "CALL", 17 }, { "CZ", 17 }, { "CNZ", 17 }, { "CC", 17 }, { "CNC", 17 },
+	{ "CP", 17 }, { "CM", 17 }, { "CPO", 17 }, { "CPE", 17 },
+	{ "RZ", 11 }, { "RNZ", 11 }, { "RC", 11 }, { "RNC", 11 },
+	{ "RP", 11 }, { "RM", 11 }, { "RPO", 11 }, { "RPE", 11 },
+	{ NULL, }
+};
+
+static const struct target {
+	const char *name;
+	uint32_t ops;		/* Extra instructions allowed */
+	const struct opcycles *cycles;
+	uint8_t fdiff;
+} targets[] = {
+	{ "8080", 0, cycles_8080, FD_ANA_AC },
+	{ "8085", OP_8085, NULL, 0 },
+	{ "z80", OP_Z80, cycles_z80, FD_Z80 },
+	{ NULL, }
+};
+
+#define NOPS	(sizeof(ops) / sizeof(ops[0]))
+
+/*
+ *	An optimizer instance. It holds the options, the rule table, where
+ *	the output goes and how to give up on an error. The IR and the rest
+ *	of the working state are shared and set up afresh for each file, so
+ *	instances take turns rather than running at once. ctx is the one
+ *	running.
+ */
+struct opt85 {
+	/* A rewrite is only made if it doesn't make the code worse by the
+	   weighted sum of bytes and T-states. -Os weighs size, -Ot weighs
+	   speed and by default we take a mix of the two */
+	unsigned int cost_bytes;
+	unsigned int cost_cycles;
+	const struct target *cpu;
+	uint8_t cycles[NOPS];	/* T-states of each op on the target */
+	int debug;
+	char *cachedir;
+	struct rule **rulehash;
+	unsigned int nrules;
+	uint64_t rulesum;	/* For the cache key */
+	FILE *rulefp;		/* Rules being loaded */
+	/* Text fed to us for the next run */
+	char *text;
+	size_t textlen, textsize;
+	FILE *out;
+	FILE *cachefp;		/* Cache entry being written */
+	char *cachetmp;
+	jmp_buf fail;
+	char err[160];
+};
+
+static PERTHREAD struct opt85 *ctx;
+
+/* Give up on this run and let the caller have the reason */
+static void fail(const char *fmt, ...)
 {
-	fprintf(stderr, "%d: %s\n", linenum, p);
-	exit(1);
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(ctx->err, sizeof(ctx->err), fmt, ap);
+	va_end(ap);
+	longjmp(ctx->fail, 1);
 }
 
-static char regname(int reg)
+/* Can the target run this instruction */
+static int op_allowed(struct optab *o)
 {
-	if (reg == MEM_HL)
-		return 'M';
-	if (reg <= REG_PSW)
-		return "?ABCDEHLF"[reg];
-	fprintf(stderr, "%d: bad regname %d\n", linenum, reg);
-	exit(1);
+	return !(o->flags & (OP_8085 | OP_Z80) & ~ctx->cpu->ops);
 }
 
-void badreg8(void)
+static int set_target(struct opt85 *c, const char *name)
 {
-	error("Expected A,B,C,D,E,H,L or M");
+	const struct target *t;
+	const struct opcycles *p;
+	unsigned int n;
+
+	for (t = targets; t->name; t++)
+		if (strcasecmp(t->name, name) == 0)
+			break;
+	if (t->name == NULL)
+		return 0;
+	c->cpu = t;
+	for (n = 0; n < NOPS; n++)
+		c->cycles[n] = ops[n].cycles;
+	for (p = t->cycles; p && p->op; p++)
+		c->cycles[find_operation(p->op) - ops] = p->cycles;
+	return 1;
 }
 
-void badreg16(void)
+static unsigned int cost_op(struct optab *o, int r)
 {
-	error("Expected PSW, SP, B, D or H");
+	unsigned int c = ctx->cycles[o - ops];
+	/* Going via (HL) takes longer, and longer still to write it back */
+	if (r == MEM_HL)
+		c += (o->flags & OP_REGMOD) ? 6 : 3;
+	return o->bytes * ctx->cost_bytes + c * ctx->cost_cycles;
 }
 
-static void print_regmap(unsigned int m)
+/* Cost of an instruction given as text */
+static unsigned int cost_text(const char *t)
 {
-	int i;
-	for (i = REG_A; i <= REG_L; i++) {
-		if (m & (1 << i))
-			putchar(regname(i));
-		else
-			putchar('-');
+	char op[8];
+	unsigned int l = 0;
+	int r = 0;
+
+	while (*t && !isspace(*t) && l < sizeof(op) - 1)
+		op[l++] = *t++;
+	op[l] = 0;
+	/* Look for M as an operand */
+	while (*t) {
+		if (toupper(*t) == 'M' && (t[1] == 0 || t[1] == ',')
+		    && (isspace(t[-1]) || t[-1] == ','))
+			r = MEM_HL;
+		t++;
 	}
+	return cost_op(find_operation(op), r);
 }
 
-static void print_values(struct effect *e)
+/* Cost of an instruction in the IR */
+static unsigned int cost(unsigned int i)
 {
-	int i;
-	for (i = REG_A; i <= REG_L; i++) {
-		putchar(regname(i));
-		if (e->value[i] & VALUE_KNOWN)
-			printf("%02X", e->value[i] & 0xFF);
-		else
-			printf("??");
+	int r = 0;
+	if (ir.dr[i] == MEM_HL || ir.sr[i] == MEM_HL)
+		r = MEM_HL;
+	return cost_op(OPINFO(i), r);
+}
+
+static struct arena *arena_new(size_t size)
+{
+	struct arena *a;
+	if (size < ARENA_CHUNK)
+		size = ARENA_CHUNK;
+	a = malloc(sizeof(struct arena) + size);
+	if (a == NULL) {
+		fail("Out of memory allocating %lu bytes.",
+			(unsigned long) size);
 	}
+	a->next = NULL;
+	a->size = size;
+	a->used = 0;
+	return a;
 }
 
-static char *do_strtok(char *m, char *e)
+/* Keep 8 byte alignment for everything we hand out */
+static void *zalloc(size_t size)
 {
-	char *p = strtok(NULL, m);
-	if (p == NULL)
-		error(e);
+	struct arena *a = arena_cur;
+	struct arena **ap = &arena_head;
+	void *p;
+
+	size = (size + 7) & ~7;
+
+	/* Use the first chunk from here on that fits, adding one if needed */
+	while (a && a->size - a->used < size)
+		a = a->next;
+	if (a == NULL) {
+		a = arena_new(size);
+		while (*ap)
+			ap = &(*ap)->next;
+		*ap = a;
+	}
+	arena_cur = a;
+	p = (uint8_t *)(a + 1) + a->used;
+	a->used += size;
+	memset(p, 0, size);
 	return p;
 }
 
+/* Throw away everything belonging to the last file but keep the memory */
+static void arena_reset(void)
+{
+	struct arena *a = arena_head;
+	while (a) {
+		a->used = 0;
+		a = a->next;
+	}
+	arena_cur = arena_head;
+}
 
 /*
- * Value tracking:
- *
- * For now we do simple constant tracking and nothing fancy. So we don't
- * track (HL) and fixed address label save/restores for optimization
+ *	Symbol names are interned per file so that values can refer to them
+ *	by number.
+ */
+struct symbol {
+	struct symbol *next;
+	const char *name;	/* Points into the input, not terminated */
+	unsigned int len;
+	unsigned int id;
+	uint8_t data;		/* Named by a directive */
+	uint8_t local;		/* Defined in this file and not exported */
+};
+
+#define SYMHASH_SIZE	256
+
+static PERTHREAD struct symbol *symhash[SYMHASH_SIZE];
+static PERTHREAD unsigned int nsyms;
+
+/*
+ *	Names defined and exported anywhere in the file. The file is scanned
+ *	for these before we start as a function may use data defined after it.
  */
-static uint16_t reg_value(struct effect *e, int reg)
+struct fname {
+	struct fname *next;
+	const char *name;	/* Points into the input, not terminated */
+	unsigned int len;
+	uint8_t flags;
+#define FN_DEFINED	1
+#define FN_EXPORTED	2
+};
+
+static PERTHREAD struct fname *fnamehash[SYMHASH_SIZE];
+
+static void file_name(const char *p, unsigned int len, uint8_t flags)
 {
-	if (e->value[reg] & VALUE_KNOWN)
-		return e->value[reg] & 0xFF;
-	fprintf(stderr, "Regval %c is not known.\n", regname(reg));
-	error("attempt to consume unknown value");
-	return 0;
+	unsigned int h = 0;
+	unsigned int n;
+	struct fname *f;
+
+	for (n = 0; n < len; n++)
+		h = h * 31 + p[n];
+	h &= SYMHASH_SIZE - 1;
+	for (f = fnamehash[h]; f; f = f->next)
+		if (f->len == len && memcmp(f->name, p, len) == 0)
+			break;
+	if (f == NULL) {
+		f = malloc(sizeof(struct fname));
+		if (f == NULL)
+			fail("Out of memory.");
+		f->name = p;
+		f->len = len;
+		f->flags = 0;
+		f->next = fnamehash[h];
+		fnamehash[h] = f;
+	}
+	f->flags |= flags;
 }
 
-static void clear_reg_value(struct effect *e, int reg)
+static struct fname *find_file_name(const char *p, unsigned int len)
 {
-	if (reg > REG_L)
-		return;
-	e->value[reg] = 0;
+	unsigned int h = 0;
+	unsigned int n;
+	struct fname *f;
+
+	for (n = 0; n < len; n++)
+		h = h * 31 + p[n];
+	h &= SYMHASH_SIZE - 1;
+	for (f = fnamehash[h]; f; f = f->next)
+		if (f->len == len && memcmp(f->name, p, len) == 0)
+			return f;
+	return NULL;
 }
 
-static void set_reg_value(struct effect *e, int reg, int v)
+static int file_local(const char *p, unsigned int len)
 {
-	if (reg > REG_L)	/* Don't track M etc */
-		return;
-	e->value[reg] = (v & 0xFF) | VALUE_KNOWN;
+	struct fname *f = find_file_name(p, len);
+	return f && f->flags == FN_DEFINED;
 }
 
-static int know_reg_value(struct effect *e, int reg)
+static void file_names_reset(void)
 {
-	if (reg > REG_L)	/* Untracked */
-		return 0;
-	return e->value[reg] & VALUE_KNOWN;
+	unsigned int n;
+	for (n = 0; n < SYMHASH_SIZE; n++) {
+		while (fnamehash[n]) {
+			struct fname *f = fnamehash[n];
+			fnamehash[n] = f->next;
+			free(f);
+		}
+	}
 }
 
-static uint16_t pair_value(struct effect *e, int reg)
+static struct symbol *lookup_symbol(const char *p, unsigned int len)
 {
-	uint16_t v = reg_value(e, reg) << 8;
-	v |= reg_value(e, reg + 1);
-	return v;
+	unsigned int h = 0;
+	unsigned int n;
+	struct symbol *s;
+
+	for (n = 0; n < len; n++)
+		h = h * 31 + p[n];
+	h &= SYMHASH_SIZE - 1;
+	for (s = symhash[h]; s; s = s->next)
+		if (s->len == len && memcmp(s->name, p, len) == 0)
+			return s;
+	s = zalloc(sizeof(struct symbol));
+	s->name = p;
+	s->len = len;
+	s->id = ++nsyms;
+	s->local = file_local(p, len);
+	s->next = symhash[h];
+	symhash[h] = s;
+	return s;
 }
 
-static void set_pair_value(struct effect *e, int reg, int v)
+static unsigned int find_symbol(const char *p, unsigned int len)
 {
-	set_reg_value(e, reg + 1, v & 0xFF);
-	set_reg_value(e, reg, v >> 8);
+	return lookup_symbol(p, len)->id;
 }
 
-static int know_pair_value(struct effect *e, int reg)
+/* Is sym the interned name. The tables of helpers are shared by every
+   thread so we look their names up rather than keep the numbers */
+static int is_symbol(unsigned int sym, const char *name)
 {
-	if (know_reg_value(e, reg) && know_reg_value(e, reg + 1))
-		return 1;
-	return 0;
+	return sym && sym == find_symbol(name, strlen(name));
 }
 
-static int find_reg_value(struct effect *e, int val)
+static void symbol_reset(void)
 {
-	int i;
-	if (val == CONST_UNKNOWN)
-		return 0;
-
-	for (i = REG_A; i <= REG_L; i++) {
-		if (know_reg_value(e, i)
-		    && reg_value(e, i) == (val & 0xFF))
-			return i;
-	}
-	return 0;
+	memset(symhash, 0, sizeof(symhash));
+	nsyms = 0;
 }
 
-/* For now on a label we require everything is as the compiler put it */
-static void invalidate_regs(struct effect *e)
+/* Which symbol ids are defined in this file and not exported, so nothing
+   outside can see them. Lives in the arena for the current pass */
+static PERTHREAD uint8_t *symlocal;
+
+static void find_local_symbols(void)
 {
-	int i;
-	for (i = REG_A; i <= REG_L; i++)
-		e->value[i] = 0;
-	e->need = REGM_ALL;
+	struct symbol *sp;
+	unsigned int i;
+
+	symlocal = zalloc(nsyms + 1);
+	for (i = 0; i < SYMHASH_SIZE; i++)
+		for (sp = symhash[i]; sp; sp = sp->next)
+			symlocal[sp->id] = sp->local;
 }
 
-static struct instruction *make_instruction(void)
+static void error(const char *p)
 {
-	struct instruction *i = zalloc(sizeof(struct instruction));
-	struct effect *e = zalloc(sizeof(struct effect));
-
-	i->next = e;
-	e->next = NULL;
-	e->prev = i;
-	return i;
+	fail("%d: %s", linenum, p);
 }
 
-struct instruction *new_instruction(void)
+/* With -d we report what the passes do and dump the IR instead of
+   writing the code */
+static void trace(const char *fmt, ...)
 {
-	struct instruction *i = make_instruction();
+	va_list ap;
+	if (!ctx->debug)
+		return;
+	va_start(ap, fmt);
+	vfprintf(ctx->out, fmt, ap);
+	va_end(ap);
+}
 
-	if (codetail) {
-		i->prev = codetail->next;
-		codetail->next->next = i;
-		codetail = i;
-	} else {
-		i->prev = &dummy_effect;
-		codetail = codehead = i;
-	}
-	return i;
+static char regname(int reg)
+{
+	if (reg == MEM_HL)
+		return 'M';
+	if (reg <= REG_PSW)
+		return "?ABCDEHLF"[reg];
+	fail("%d: bad regname %d", linenum, reg);
+	return '?';
 }
 
-struct instruction *append_instruction(struct instruction *i)
+static void badreg8(void)
 {
-	struct instruction *n = make_instruction();
-	n->next->next = i->next->next;
-	i->next->next = n;
-	n->prev = i->next;
-	if (n->next->next)
-		n->next->next->prev = n->next;
-	else
-		codetail = n;
-	return n;
+	error("Expected A,B,C,D,E,H,L or M");
 }
 
-struct label *new_label(void)
+static void badreg16(void)
 {
-	return zalloc(sizeof(struct label));
+	error("Expected PSW, SP, B, D or H");
 }
 
+static void print_regmap(unsigned int m)
+{
+	int i;
+	for (i = REG_A; i <= REG_L; i++) {
+		if (m & (1 << i))
+			fputc(regname(i), ctx->out);
+		else
+			fputc('-', ctx->out);
+	}
+}
 
 /*
- *	This isn't a true syntax decoder. We are parsing the good output
- *	of the compiler in the format it creates, nothing more.
+ * Value tracking:
+ *
+ * For now we do simple constant tracking and nothing fancy. So we don't
+ * track (HL) and fixed address label save/restores for optimization.
+ * Registers that are not fully known may still have some bits or a
+ * range known, which is enough to prove some operations do nothing.
  */
 
-static int DecodeReg8(const char *r)
+static void bits_unknown(struct regbits *b)
 {
-	if (r[1])
-		badreg8();
-	switch (toupper(r[0])) {
-	case 'A':
-		return REG_A;
-	case 'B':
-		return REG_B;
-	case 'C':
-		return REG_C;
-	case 'D':
-		return REG_D;
-	case 'E':
-		return REG_E;
-	case 'H':
-		return REG_H;
-	case 'L':
-		return REG_L;
-	}
-	badreg8();
-	exit(1);
+	b->zero = 0;
+	b->one = 0;
+	b->lo = 0;
+	b->hi = 0xFF;
 }
 
-static int DecodeReg8M(const char *r)
+static void bits_const(struct regbits *b, uint8_t v)
 {
-	if (r[1])
-		badreg8();
-	if (r[0] == 'm' || r[0] == 'M')
-		return MEM_HL;
-	return DecodeReg8(r);
+	b->zero = ~v;
+	b->one = v;
+	b->lo = v;
+	b->hi = v;
 }
 
-static int DecodePair(const char *r)
+static int bits_known(struct regbits *b)
 {
-	if (strcasecmp(r, "PSW") == 0)
-		return REG_PSW;
-	if (strcasecmp(r, "SP") == 0)
-		return REG_SP;
-	if (r[1])
-		badreg16();
-	switch (toupper(r[0])) {
-	case 'B':
-		return REG_B;
-	case 'D':
-		return REG_D;
-	case 'H':
-		return REG_H;
-	}
-	badreg16();
-	exit(1);
+	return (uint8_t)(b->zero | b->one) == 0xFF;
 }
 
-static int DecodeConst(const char *p)
+/* Tighten the range using the bits and the bits using the range */
+static void bits_normalise(struct regbits *b)
 {
-	char *t;
-	long v = strtol(p, &t, 0);
-	if (t == p)
-		return CONST_UNKNOWN;
-	return v;
+	uint8_t m;
+
+	if (b->zero & b->one) {
+		/* Contradiction: only on a path we can't reach */
+		bits_unknown(b);
+		return;
+	}
+	if (b->lo < b->one)
+		b->lo = b->one;
+	m = ~b->zero;
+	if (b->hi > m)
+		b->hi = m;
+	if (b->lo > b->hi) {
+		bits_unknown(b);
+		return;
+	}
+	/* Bits above the top bit that varies across the range are fixed */
+	m = b->lo ^ b->hi;
+	m |= m >> 1;
+	m |= m >> 2;
+	m |= m >> 4;
+	b->one |= b->lo & ~m;
+	b->zero |= ~b->lo & ~m;
 }
 
-static void ParseR8Pair(int *sr, int *dr)
+/*
+ *	Add with a carry in of 0, 1 or -1 for unknown. This is the usual
+ *	known bits adder: a result bit is known when both inputs and the
+ *	carry into it are known.
+ */
+static void bits_add(struct regbits *r, struct regbits *a, struct regbits *b,
+		     int cin)
 {
-	char *r = do_strtok(",", "comma expected");
-	char *d = do_strtok("", "register or m expected");
+	unsigned int sum0 = (uint8_t)~a->zero + (uint8_t)~b->zero + (cin != 0);
+	unsigned int sum1 = a->one + b->one + (cin == 1);
+	unsigned int ckz = ~(sum0 ^ a->zero ^ b->zero);
+	unsigned int cko = sum1 ^ a->one ^ b->one;
+	unsigned int known = (a->zero | a->one) & (b->zero | b->one) & (ckz | cko);
+	unsigned int lo = a->lo + b->lo + (cin == 1);
+	unsigned int hi = a->hi + b->hi + (cin != 0);
 
-	*sr = DecodeReg8M(r);
-	*dr = DecodeReg8M(d);
+	r->zero = ~sum0 & known;
+	r->one = sum1 & known;
+	/* The range survives only if it doesn't straddle a wrap */
+	if ((lo >> 8) == (hi >> 8)) {
+		r->lo = lo;
+		r->hi = hi;
+	} else {
+		r->lo = 0;
+		r->hi = 0xFF;
+	}
+	bits_normalise(r);
+}
 
-	/* Shouldn't ever see these */
-	if (*sr == *dr && *sr == MEM_HL)
-		error("invalid move");
+/* Subtract is add of the complement with the carry inverted */
+static void bits_not(struct regbits *r, struct regbits *a)
+{
+	struct regbits t = *a;
+	r->zero = t.one;
+	r->one = t.zero;
+	r->lo = ~t.hi;
+	r->hi = ~t.lo;
 }
 
-static void ParseR8Const(int *sr, int *cv)
+static void bits_sub(struct regbits *r, struct regbits *a, struct regbits *b,
+		     int bin)
 {
-	char *r = do_strtok(",", "comma expected");
-	char *d = do_strtok("", "constant expected");
-	*sr = DecodeReg8(r);
-	*cv = DecodeConst(d);
+	struct regbits nb;
+	bits_not(&nb, b);
+	bits_add(r, a, &nb, bin == -1 ? -1 : !bin);
 }
 
-static void ParseR8M(int *sr)
+static void bits_and(struct regbits *r, struct regbits *a, struct regbits *b)
 {
-	char *r = do_strtok("", "register or m expected");
-	*sr = DecodeReg8M(r);
+	uint8_t hi = a->hi < b->hi ? a->hi : b->hi;
+	r->zero = a->zero | b->zero;
+	r->one = a->one & b->one;
+	r->lo = 0;
+	r->hi = hi;
+	bits_normalise(r);
 }
 
-static void ParsePair(int *r)
+static void bits_or(struct regbits *r, struct regbits *a, struct regbits *b)
 {
-	char *p = do_strtok("", "register pair expected");
-	*r = DecodePair(p);
+	uint8_t lo = a->lo > b->lo ? a->lo : b->lo;
+	r->zero = a->zero & b->zero;
+	r->one = a->one | b->one;
+	r->lo = lo;
+	r->hi = 0xFF;
+	bits_normalise(r);
 }
 
-static void ParsePairConst(int *r, int *c)
+static void bits_xor(struct regbits *r, struct regbits *a, struct regbits *b)
 {
-	char *p = do_strtok(",", "comma expected");
-	char *d = do_strtok("", "constant expected");
-	*r = DecodePair(p);
-	*c = DecodeConst(d);
+	uint8_t zero = (a->zero & b->zero) | (a->one & b->one);
+	uint8_t one = (a->zero & b->one) | (a->one & b->zero);
+	r->zero = zero;
+	r->one = one;
+	r->lo = 0;
+	r->hi = 0xFF;
+	bits_normalise(r);
 }
 
-static void ParseConst(int *a)
+/* Rotate left or right by one. The bit shifted in is given as 0, 1 or -1
+   for unknown. RLC/RRC shift in the bit that fell out */
+static void bits_rotate(struct regbits *r, struct regbits *a, int left, int in)
 {
-	char *p = do_strtok("", "constant expected");
-	*a = DecodeConst(p);
+	uint8_t zero, one, m;
+	if (left) {
+		zero = a->zero << 1;
+		one = a->one << 1;
+		m = 0x01;
+	} else {
+		zero = a->zero >> 1;
+		one = a->one >> 1;
+		m = 0x80;
+	}
+	if (in == 0)
+		zero |= m;
+	if (in == 1)
+		one |= m;
+	r->zero = zero;
+	r->one = one;
+	r->lo = 0;
+	r->hi = 0xFF;
+	bits_normalise(r);
 }
 
-static void ParseAddr(int *a)
+/* Is the register known never to be zero ? */
+static int bits_nonzero(struct regbits *b)
 {
-	/* TODO */
-	ParseConst(a);
+	return b->one || b->lo;
 }
 
-/* Given a register pair return the mask of bits it affects */
+static struct regbits *reg_bits(unsigned int e, int reg)
+{
+	return &ir.bits[e][reg];
+}
 
-static int PairMask(int reg)
+static uint16_t reg_value(unsigned int e, int reg)
 {
-	switch (reg) {
-	case REG_B:
-		return REGM_B | REGM_C;
-	case REG_D:
-		return REGM_D | REGM_E;
-	case REG_H:
-		return REGM_H | REGM_L;
-	case REG_PSW:
-		return REGM_PSW | REGM_A;
-	case REG_SP:
-		return REGM_SP;
-	}
-	error("invalid pair to mask");
+	if (reg <= REG_L && bits_known(reg_bits(e, reg)))
+		return ir.bits[e][reg].one;
+	fail("%d: value of %c is not known", linenum, regname(reg));
 	return 0;
 }
 
-static void parse_instruction(struct instruction *i)
+static struct regsym *reg_sym(unsigned int e, int reg)
 {
-	char *p = strdup(i->op);
-	char *op = strtok(p, " \t");
-	int l, r;
-	struct optab *o;
+	return &ir.syms[e][reg];
+}
+
+/*
+ *	Every value a register gets is given a number, and copies share the
+ *	number of their source. Two registers with the same number hold the
+ *	same value even if we have no idea what it is. Number 0 means we
+ *	don't know anything.
+ */
+static PERTHREAD uint32_t nextvn;
+
+static void new_value(unsigned int e, int reg)
+{
+	ir.vn[e][reg] = ++nextvn;
+}
+
+static void clear_reg_value(unsigned int e, int reg)
+{
+	if (reg > REG_L)
+		return;
+	bits_unknown(reg_bits(e, reg));
+	reg_sym(e, reg)->sym = 0;
+	new_value(e, reg);
+}
+
+static void set_reg_value(unsigned int e, int reg, int v)
+{
+	if (reg > REG_L)	/* Don't track M etc */
+		return;
+	bits_const(reg_bits(e, reg), v);
+	reg_sym(e, reg)->sym = 0;
+	new_value(e, reg);
+}
+
+static int know_reg_value(unsigned int e, int reg)
+{
+	if (reg > REG_L)	/* Untracked */
+		return 0;
+	return bits_known(reg_bits(e, reg));
+}
+
+/* Copy whatever we know about a register from one point to another */
+static void copy_reg_bits(unsigned int e, int reg, unsigned int from, int sreg)
+{
+	if (reg > REG_L)
+		return;
+	if (sreg > REG_L)
+		clear_reg_value(e, reg);
+	else {
+		*reg_bits(e, reg) = *reg_bits(from, sreg);
+		*reg_sym(e, reg) = *reg_sym(from, sreg);
+		ir.vn[e][reg] = ir.vn[from][sreg];
+	}
+}
+
+/* Do two registers hold the same value, however we know it */
+static int same_value(unsigned int e, int r1, int r2)
+{
+	struct regsym *s1, *s2;
+
+	if (r1 > REG_L || r2 > REG_L)
+		return 0;
+	if (ir.vn[e][r1] && ir.vn[e][r1] == ir.vn[e][r2])
+		return 1;
+	if (know_reg_value(e, r1) && know_reg_value(e, r2))
+		return reg_value(e, r1) == reg_value(e, r2);
+	s1 = reg_sym(e, r1);
+	s2 = reg_sym(e, r2);
+	return s1->sym && s1->sym == s2->sym && s1->off == s2->off
+	    && s1->high == s2->high;
+}
+
+static void print_values(unsigned int e)
+{
+	int i;
+	for (i = REG_A; i <= REG_L; i++) {
+		fputc(regname(i), ctx->out);
+		if (know_reg_value(e, i))
+			fprintf(ctx->out, "%02X", reg_value(e, i));
+		else
+			fprintf(ctx->out, "??");
+	}
+}
+
+/*
+ *	Operands are never copied. The tokenizer hands back slices of the
+ *	input line and the decoders work directly on those.
+ */
+struct slice {
+	const char *p;
+	unsigned int len;
+};
+
+static PERTHREAD const char *tokp, *toke;	/* Rest of the line being parsed */
+
+static void trim(struct slice *s)
+{
+	while (s->len && isspace(*s->p)) {
+		s->p++;
+		s->len--;
+	}
+	while (s->len && isspace(s->p[s->len - 1]))
+		s->len--;
+}
+
+/* Return everything up to the separator, or the rest of the line if
+   the separator is 0 */
+static struct slice get_field(char sep, const char *e)
+{
+	struct slice s;
+	const char *x = tokp;
+
+	if (sep)
+		while (x < toke && *x != sep)
+			x++;
+	else
+		x = toke;
+	s.p = tokp;
+	s.len = x - tokp;
+	trim(&s);
+	if (s.len == 0 || (sep && x == toke))
+		error(e);
+	tokp = x < toke ? x + 1 : toke;
+	return s;
+}
+
+static int slice_is(struct slice *s, const char *str)
+{
+	return strlen(str) == s->len && strncasecmp(s->p, str, s->len) == 0;
+}
+
+static uint16_t pair_value(unsigned int e, int reg)
+{
+	uint16_t v = reg_value(e, reg) << 8;
+	v |= reg_value(e, reg + 1);
+	return v;
+}
+
+static void set_pair_value(unsigned int e, int reg, int v)
+{
+	set_reg_value(e, reg + 1, v & 0xFF);
+	set_reg_value(e, reg, v >> 8);
+}
+
+static int know_pair_value(unsigned int e, int reg)
+{
+	if (know_reg_value(e, reg) && know_reg_value(e, reg + 1))
+		return 1;
+	return 0;
+}
+
+/* A pair is symbolically known if both halves are of the same value */
+static int know_pair_sym(unsigned int e, int reg)
+{
+	struct regsym *h = reg_sym(e, reg);
+	struct regsym *l = reg_sym(e, reg + 1);
+	return h->sym && h->high && l->sym == h->sym && !l->high
+	    && l->off == h->off;
+}
+
+static void set_pair_sym(unsigned int e, int reg, unsigned int sym,
+			 uint16_t off)
+{
+	struct regsym *h = reg_sym(e, reg);
+	struct regsym *l = reg_sym(e, reg + 1);
+	bits_unknown(reg_bits(e, reg));
+	bits_unknown(reg_bits(e, reg + 1));
+	h->sym = l->sym = sym;
+	h->off = l->off = off;
+	h->high = 1;
+	l->high = 0;
+	new_value(e, reg);
+	new_value(e, reg + 1);
+}
+
+static int find_reg_sym(unsigned int e, unsigned int sym, uint16_t off,
+			int high)
+{
+	int i;
+	for (i = REG_A; i <= REG_L; i++) {
+		struct regsym *s = reg_sym(e, i);
+		if (s->sym == sym && s->off == off && s->high == high)
+			return i;
+	}
+	return 0;
+}
+
+static int find_reg_value(unsigned int e, int val)
+{
+	int i;
+	if (val == CONST_UNKNOWN)
+		return 0;
+
+	for (i = REG_A; i <= REG_L; i++) {
+		if (know_reg_value(e, i)
+		    && reg_value(e, i) == (val & 0xFF))
+			return i;
+	}
+	return 0;
+}
+
+/* For now on a label we require everything is as the compiler put it */
+static void invalidate_regs(unsigned int e)
+{
+	int n;
+	for (n = REG_A; n <= REG_L; n++)
+		clear_reg_value(e, n);
+	ir.tos[e][0] = ir.tos[e][1] = 0;
+	ir.fknown[e] = 0;
+	ir.flags[e] &= ~HL_SPBIAS;
+	ir.need[e] = REGM_ALL;
+}
+
+static void *ir_resize(void *p, size_t elsize, unsigned int size)
+{
+	p = realloc(p, elsize * size);
+	if (p == NULL)
+		fail("Out of memory.");
+	return p;
+}
+
+/* The arrays are kept between files so batch mode doesn't regrow them */
+static unsigned int ir_alloc(void)
+{
+	unsigned int n;
+	int r;
+	if (ir.count == ir.size) {
+		ir.size = ir.size ? ir.size * 2 : 1024;
+#define X(f)	ir.f = ir_resize(ir.f, sizeof(*ir.f), ir.size);
+		IR_FIELDS
+#undef X
+	}
+	n = ir.count++;
+#define X(f)	memset(&ir.f[n], 0, sizeof(*ir.f));
+	IR_FIELDS
+#undef X
+	for (r = REG_A; r <= REG_L; r++)
+		bits_unknown(&ir.bits[n][r]);
+	return n;
+}
+
+static void ir_reset(void)
+{
+	ir.count = 0;
+	ir_alloc();
+}
+
+/*
+ *	The edit journal. Between ir_begin() and ir_commit() or ir_rollback()
+ *	the first change to each instruction saves all it held, so a pass can
+ *	try a rewrite, see what it costs and put it back if it doesn't pay.
+ *	New instructions are simply dropped. Only the changes made by the
+ *	editing helpers are saved, and nothing may compact the IR while a
+ *	journal is open.
+ */
+#define X(f)	+ sizeof(*ir.f)
+static const size_t ir_rowsize = 0 IR_FIELDS;
+#undef X
+
+struct journal {
+	int open;
+	unsigned int count;	/* Instructions when we began */
+	unsigned int n;
+	unsigned int size;
+	uint32_t *at;		/* Instructions saved */
+	uint32_t *cost;		/* their cost then */
+	uint8_t *rows;		/* and what they held */
+	uint32_t *seen;		/* Epoch each was last saved in */
+	unsigned int seensize;
+	uint32_t epoch;
+};
+
+static PERTHREAD struct journal jr;
+
+static unsigned int live_cost(unsigned int i)
+{
+	return ir.dead[i] ? 0 : cost(i);
+}
+
+/* About to change instruction i */
+static void ir_touch(unsigned int i)
+{
+	uint8_t *p;
+
+	if (!jr.open || i >= jr.count || jr.seen[i] == jr.epoch)
+		return;
+	if (jr.n == jr.size) {
+		jr.size = jr.size ? jr.size * 2 : 64;
+		jr.at = ir_resize(jr.at, sizeof(*jr.at), jr.size);
+		jr.cost = ir_resize(jr.cost, sizeof(*jr.cost), jr.size);
+		jr.rows = ir_resize(jr.rows, ir_rowsize, jr.size);
+	}
+	jr.seen[i] = jr.epoch;
+	jr.at[jr.n] = i;
+	jr.cost[jr.n] = live_cost(i);
+	p = jr.rows + jr.n++ * ir_rowsize;
+#define X(f)	memcpy(p, &ir.f[i], sizeof(*ir.f)); p += sizeof(*ir.f);
+	IR_FIELDS
+#undef X
+}
+
+static void ir_begin(void)
+{
+	if (jr.seensize < ir.count) {
+		jr.seen = ir_resize(jr.seen, sizeof(*jr.seen), ir.size);
+		memset(jr.seen + jr.seensize, 0,
+		       (ir.size - jr.seensize) * sizeof(*jr.seen));
+		jr.seensize = ir.size;
+	}
+	/* Epoch 0 is never current so a wrap starts clean */
+	if (++jr.epoch == 0) {
+		memset(jr.seen, 0, jr.seensize * sizeof(*jr.seen));
+		jr.epoch = 1;
+	}
+	jr.open = 1;
+	jr.count = ir.count;
+	jr.n = 0;
+}
+
+static void ir_commit(void)
+{
+	jr.open = 0;
+}
+
+static void ir_rollback(void)
+{
+	const uint8_t *p;
+	unsigned int i;
+
+	while (jr.n) {
+		jr.n--;
+		i = jr.at[jr.n];
+		p = jr.rows + jr.n * ir_rowsize;
+#define X(f)	memcpy(&ir.f[i], p, sizeof(*ir.f)); p += sizeof(*ir.f);
+		IR_FIELDS
+#undef X
+	}
+	ir.count = jr.count;
+	jr.open = 0;
+}
+
+/* How much the edits since ir_begin() changed the cost by */
+static int ir_cost_delta(void)
+{
+	unsigned int k;
+	int d = 0;
+
+	for (k = 0; k < jr.n; k++)
+		d += (int)live_cost(jr.at[k]) - (int)jr.cost[k];
+	for (k = jr.count; k < ir.count; k++)
+		d += live_cost(k);
+	return d;
+}
+
+/* Link instruction n in after instruction p */
+static void ir_link(unsigned int n, unsigned int p)
+{
+	ir_touch(n);
+	ir_touch(p);
+	ir_touch(ir.next[p]);
+	ir.next[n] = ir.next[p];
+	ir.prev[n] = p;
+	ir.prev[ir.next[p]] = n;
+	ir.next[p] = n;
+}
+
+static void ir_unlink(unsigned int n)
+{
+	ir_touch(ir.prev[n]);
+	ir_touch(ir.next[n]);
+	ir.next[ir.prev[n]] = ir.next[n];
+	ir.prev[ir.next[n]] = ir.prev[n];
+}
+
+static PERTHREAD uint8_t *ir_scratch;
+static PERTHREAD unsigned int ir_scratchsize;
+static PERTHREAD uint32_t *ir_order;
+
+static void ir_permute(void *base, size_t elsize, uint32_t *order,
+		       unsigned int count)
+{
+	uint8_t *p = base;
+	unsigned int n;
+	for (n = 1; n < count; n++)
+		memcpy(ir_scratch + n * elsize, p + order[n] * elsize, elsize);
+	memcpy(p + elsize, ir_scratch + elsize, (count - 1) * elsize);
+}
+
+/* Drop the tombstones and put the live instructions back in order */
+static void ir_compact(void)
+{
+	uint32_t *order;
+	unsigned int n, k = 1;
+	size_t w = 0;
+
+	/* The scratch area holds the widest field for every instruction */
+	if (ir_scratchsize < ir.size) {
+#define X(f)	if (sizeof(*ir.f) > w) w = sizeof(*ir.f);
+		IR_FIELDS
+#undef X
+		ir_scratchsize = ir.size;
+		ir_scratch = ir_resize(ir_scratch, w, ir.size);
+		ir_order = ir_resize(ir_order, sizeof(*ir_order), ir.size);
+	}
+	order = ir_order;
+	for (n = ir.next[0]; n; n = ir.next[n])
+		order[k++] = n;
+#define X(f)	ir_permute(ir.f, sizeof(*ir.f), order, k);
+	IR_FIELDS
+#undef X
+	for (n = 1; n < k; n++) {
+		ir.next[n] = n + 1;
+		ir.prev[n] = n - 1;
+		if (ir.label[n])
+			ir.label[n]->instruction = n;
+	}
+	ir.next[0] = k > 1 ? 1 : 0;
+	ir.prev[0] = k - 1;
+	if (k > 1)
+		ir.next[k - 1] = 0;
+	ir.count = k;
+}
+
+static unsigned int new_instruction(void)
+{
+	unsigned int n = ir_alloc();
+	ir_link(n, ir.prev[0]);
+	return n;
+}
+
+static unsigned int append_instruction(unsigned int i)
+{
+	unsigned int n = ir_alloc();
+	ir_link(n, i);
+	/* Until it does something it needs what the code after did */
+	ir.need[n] = ir.need[i];
+	return n;
+}
+
+static struct label *new_label(void)
+{
+	return zalloc(sizeof(struct label));
+}
+
+
+/*
+ *	This isn't a true syntax decoder. We are parsing the good output
+ *	of the compiler in the format it creates, nothing more.
+ */
+
+static int DecodeReg8(struct slice *r)
+{
+	if (r->len != 1)
+		badreg8();
+	switch (toupper(r->p[0])) {
+	case 'A':
+		return REG_A;
+	case 'B':
+		return REG_B;
+	case 'C':
+		return REG_C;
+	case 'D':
+		return REG_D;
+	case 'E':
+		return REG_E;
+	case 'H':
+		return REG_H;
+	case 'L':
+		return REG_L;
+	}
+	badreg8();
+	return 0;
+}
+
+static int DecodeReg8M(struct slice *r)
+{
+	if (r->len != 1)
+		badreg8();
+	if (r->p[0] == 'm' || r->p[0] == 'M')
+		return MEM_HL;
+	return DecodeReg8(r);
+}
+
+static int DecodePair(struct slice *r)
+{
+	if (slice_is(r, "PSW"))
+		return REG_PSW;
+	if (slice_is(r, "SP"))
+		return REG_SP;
+	if (r->len != 1)
+		badreg16();
+	switch (toupper(r->p[0])) {
+	case 'B':
+		return REG_B;
+	case 'D':
+		return REG_D;
+	case 'H':
+		return REG_H;
+	}
+	badreg16();
+	return 0;
+}
+
+/* Numbers as C writes them. Anything else, including expressions, is
+   not a constant we understand */
+static int DecodeConst(struct slice *s)
+{
+	const char *p = s->p;
+	const char *e = p + s->len;
+	int base = 10;
+	int neg = 0;
+	long v = 0;
+
+	if (p < e && (*p == '-' || *p == '+'))
+		neg = *p++ == '-';
+	if (p == e)
+		return CONST_UNKNOWN;
+	if (*p == '0') {
+		base = 8;
+		if (e - p > 2 && (p[1] == 'x' || p[1] == 'X')) {
+			base = 16;
+			p += 2;
+		}
+	}
+	while (p < e) {
+		int d;
+		if (isdigit(*p))
+			d = *p - '0';
+		else if (isxdigit(*p))
+			d = toupper(*p) - 'A' + 10;
+		else
+			return CONST_UNKNOWN;
+		if (d >= base)
+			return CONST_UNKNOWN;
+		v = v * base + d;
+		if (v > 0xFFFF)
+			return CONST_UNKNOWN;
+		p++;
+	}
+	return neg ? -v : v;
+}
+
+/* A symbol with an optional numeric offset, eg _buf+2. Returns 0 if the
+   operand isn't of that form */
+static int DecodeSym(struct slice *s, uint16_t *off)
+{
+	const char *p = s->p;
+	const char *e = p + s->len;
+	struct slice n;
+	int v;
+
+	if (p == e || !(isalpha(*p) || *p == '_' || *p == '.'))
+		return 0;
+	while (p < e && (isalnum(*p) || *p == '_' || *p == '.' || *p == '$'))
+		p++;
+	*off = 0;
+	if (p < e) {
+		if (*p != '+' && *p != '-')
+			return 0;
+		n.p = p;
+		n.len = e - p;
+		v = DecodeConst(&n);
+		if (v == CONST_UNKNOWN)
+			return 0;
+		*off = v;
+	}
+	return find_symbol(s->p, p - s->p);
+}
+
+static void ParseR8Pair(int *sr, int *dr)
+{
+	struct slice r = get_field(',', "comma expected");
+	struct slice d = get_field(0, "register or m expected");
+
+	*sr = DecodeReg8M(&r);
+	*dr = DecodeReg8M(&d);
+
+	/* Shouldn't ever see these */
+	if (*sr == *dr && *sr == MEM_HL)
+		error("invalid move");
+}
+
+static void ParseR8Const(int *sr, int *cv)
+{
+	struct slice r = get_field(',', "comma expected");
+	struct slice d = get_field(0, "constant expected");
+	*sr = DecodeReg8M(&r);
+	*cv = DecodeConst(&d);
+}
+
+static void ParseR8M(int *sr)
+{
+	struct slice r = get_field(0, "register or m expected");
+	*sr = DecodeReg8M(&r);
+}
+
+static void ParsePair(int *r)
+{
+	struct slice p = get_field(0, "register pair expected");
+	*r = DecodePair(&p);
+}
+
+static void ParsePairConst(int *r, int *c, uint16_t *sym, uint16_t *off)
+{
+	struct slice p = get_field(',', "comma expected");
+	struct slice d = get_field(0, "constant expected");
+	*r = DecodePair(&p);
+	*c = DecodeConst(&d);
+	if (*c == CONST_UNKNOWN)
+		*sym = DecodeSym(&d, off);
+}
+
+static void ParseConst(int *a)
+{
+	struct slice p = get_field(0, "constant expected");
+	*a = DecodeConst(&p);
+}
+
+static void ParseAddr(int *a, uint16_t *sym, uint16_t *off)
+{
+	struct slice p = get_field(0, "address expected");
+	*a = DecodeConst(&p);
+	if (*a == CONST_UNKNOWN)
+		*sym = DecodeSym(&p, off);
+}
+
+/* Given a register pair return the mask of bits it affects */
+
+static int PairMask(int reg)
+{
+	switch (reg) {
+	case REG_B:
+		return REGM_B | REGM_C;
+	case REG_D:
+		return REGM_D | REGM_E;
+	case REG_H:
+		return REGM_H | REGM_L;
+	case REG_PSW:
+		return REGM_PSW | REGM_A;
+	case REG_SP:
+		return REGM_SP;
+	}
+	error("invalid pair to mask");
+	return 0;
+}
+
+/* Using M needs the address in HL as well as the memory */
+static int AddrNeed(int reg)
+{
+	if (reg == MEM_HL)
+		return REGM_H | REGM_L;
+	return 0;
+}
+
+static int RegNeed(int reg)
+{
+	return (1 << reg) | AddrNeed(reg);
+}
+
+/*
+ *	The flags each ALU operation changes and the ones it depends upon
+ */
+static const uint8_t alu_fset[] = {
+	[ALU_ADD] = FLAG_ALL, [ALU_ADC] = FLAG_ALL,
+	[ALU_SUB] = FLAG_ALL, [ALU_SBB] = FLAG_ALL,
+	[ALU_AND] = FLAG_ALL, [ALU_XOR] = FLAG_ALL,
+	[ALU_OR] = FLAG_ALL, [ALU_CMP] = FLAG_ALL,
+	[ALU_INR] = FLAG_ALL & ~FLAG_CY, [ALU_DCR] = FLAG_ALL & ~FLAG_CY,
+	[ALU_RLC] = FLAG_CY, [ALU_RRC] = FLAG_CY,
+	[ALU_RAL] = FLAG_CY, [ALU_RAR] = FLAG_CY,
+	[ALU_CMA] = 0, [ALU_DAA] = FLAG_ALL,
+	[ALU_STC] = FLAG_CY, [ALU_CMC] = FLAG_CY,
+	[ALU_INX] = 0, [ALU_DCX] = 0, [ALU_DAD] = FLAG_CY,
+	[ALU_DSUB] = FLAG_ALL, [ALU_ARHL] = FLAG_CY, [ALU_RDEL] = FLAG_CY
+};
+
+static const uint8_t alu_fuse[] = {
+	[ALU_ADC] = FLAG_CY, [ALU_SBB] = FLAG_CY,
+	[ALU_RAL] = FLAG_CY, [ALU_RAR] = FLAG_CY,
+	[ALU_DAA] = FLAG_CY | FLAG_AC, [ALU_CMC] = FLAG_CY,
+	[ALU_DAD] = 0, [ALU_RDEL] = FLAG_CY
+};
+
+/* Does execution carry on to the next instruction. We don't follow it
+   through data */
+static int falls_through(unsigned int i)
+{
+	const char *op = OPINFO(i)->op;
+	return strcmp(op, "JMP") && strcmp(op, "JR") && strcmp(op, "PCHL")
+		&& strcmp(op, "RET") && !(OPINFO(i)->flags & OP_DATA);
+}
+
+/* What an instruction kills. One that changes only some of the flags
+   leaves the rest alive so the flags pass through it */
+static uint32_t kill_mask(unsigned int i)
+{
+	struct optab *o = OPINFO(i);
+	if (o->alu && alu_fset[o->alu] != FLAG_ALL)
+		return ir.set[i] & ~REGM_PSW;
+	return ir.set[i];
+}
+
+/* What is still needed before i from after it. Nothing follows on from
+   a jump or return so whatever comes next wants nothing of it */
+static uint32_t need_past(unsigned int i)
+{
+	if (!falls_through(i))
+		return 0;
+	return ir.need[i] & ~kill_mask(i);
+}
+
+/*
+ *	Work out what an instruction needs and sets from the operation and
+ *	its operands. This is done when we parse it and again whenever a
+ *	pass rewrites it.
+ */
+static void compute_masks(unsigned int i)
+{
+	struct optab *o = OPINFO(i);
+	uint32_t need = o->imask;
+	uint32_t set = o->omask;
+
+	/* Register to register move, 8 bit. We need the source, we set
+	   the dest */
+	if (o->flags & OP_MOV) {
+		need |= RegNeed(ir.sr[i]) | AddrNeed(ir.dr[i]);
+		set |= 1 << ir.dr[i];
+	}
+	/* Immediate to register move, 8bit */
+	if (o->flags & OP_MVI) {
+		set = 1 << ir.dr[i];
+		need |= AddrNeed(ir.dr[i]);
+	}
+	if (o->flags & OP_IMMED) {
+		if (o->flags & OP_SPAIR)
+			need |= PairMask(ir.sr[i]);
+		else if (o->flags & OP_DPAIR)
+			set |= PairMask(ir.dr[i]);
+	} else if (o->flags & OP_DPAIR)
+		set |= PairMask(ir.dr[i]);
+	else if (o->flags & OP_SPAIR)
+		need |= PairMask(ir.sr[i]);
+	else if (o->flags & OP_AOP)
+		need |= RegNeed(ir.sr[i]);
+	if (o->flags & OP_REGMOD) {
+		set |= 1 << ir.dr[i];
+		need |= RegNeed(ir.dr[i]);
+	}
+	if (o->flags & OP_PAIRMOD) {
+		set |= PairMask(ir.dr[i]);
+		need |= PairMask(ir.dr[i]);
+	}
+
+	/* Save our direct needs so we can do eliminations easily */
+	ir.iset[i] = set;
+	ir.ineed[i] = need;
+
+	/* For now call/branch etc are treated as side effects so we don't
+	   remove any. Port I/O and the like must always stay */
+	if (o->flags & (OP_RET | OP_CALL | OP_BRA | OP_KEEP))
+		set |= SIDEEFFECTM;
+	ir.set[i] = set;
+	/* Anything can arrive at a label */
+	if (ir.label[i])
+		need = REGM_ALL;
+	ir_touch(ir.prev[i]);
+	ir.need[ir.prev[i]] = need | need_past(i);
+}
+
+/* Set once the values and needs are worked out for the code as it is.
+   While it is the editing helpers keep them so */
+static PERTHREAD int analysed;
+
+/*
+ *	Rebuild the need masks from scratch, ready for propagate_need() to
+ *	run again after passes have changed the code.
+ */
+static void reset_need(void)
+{
+	unsigned int i;
+	analysed = 0;
+	ir.need[0] = 0;
+	for (i = ir.next[0]; i; i = ir.next[i])
+		ir.need[i] = 0;
+	for (i = ir.next[0]; i; i = ir.next[i])
+		compute_masks(i);
+}
+
+/* Are we in a section other than .text */
+static PERTHREAD int datasect;
+
+/* Labels named by directives can be reached from places we can't see,
+   such as jump tables */
+static void parse_directive(unsigned int i, struct optab *o, const char *p,
+			    const char *e)
+{
+	while (p < e && isspace(*p))
+		p++;
+	if (strcasecmp(o->op, ".sect") == 0)
+		datasect = e - p != 5 || strncasecmp(p, ".text", 5);
+	while (p < e) {
+		const char *n = p;
+		if (*p == '\'' || *p == '"') {
+			char q = *p++;
+			while (p < e && *p != q)
+				p += *p == '\\' ? 2 : 1;
+			p++;
+			continue;
+		}
+		if (!isalpha(*p) && *p != '_' && *p != '.') {
+			/* Don't take the tail of a number as a name */
+			while (p < e && isalnum(*p))
+				p++;
+			if (p == n)
+				p++;
+			continue;
+		}
+		while (p < e && (isalnum(*p) || *p == '_' || *p == '.'))
+			p++;
+		lookup_symbol(n, p - n)->data = 1;
+	}
+	ir.opcode[i] = o - ops;
+}
+
+static void parse_instruction(unsigned int i)
+{
+	const char *p = ir.op[i];
+	const char *e = p + ir.oplen[i];
+	char op[8];
+	int l, r;
+	struct optab *o;
+
+	/* The mnemonic ends at the first white space */
+	for (l = 0; p < e && !isspace(*p); p++) {
+		if (l == sizeof(op) - 1)
+			break;
+		op[l++] = *p;
+	}
+	op[l] = 0;
+	tokp = p;
+	toke = e;
+
+	/* Should be an 8085 op code but might be meta stuff. Anything in a
+	   data section is kept as it is */
+	o = find_operation(op);
+	if ((o == NULL && *op == '.') || (datasect && l
+	    && (o == NULL || !(o->flags & OP_PSEUDO)))) {
+		o = find_operation(".");
+		while (p < e && !isspace(*p))
+			p++;
+	}
+	if (o && (o->flags & OP_PSEUDO)) {
+		parse_directive(i, o, p, e);
+		compute_masks(i);
+		return;
+	}
+	if (o == NULL || !op_allowed(o) || (p < e && !isspace(*p))) {
+		fail("%d: Unknown operation '%.*s'.", linenum,
+			ir.oplen[i], ir.op[i]);
+	}
+
+	ir.opcode[i] = o - ops;
+
+	/* Register to register move, 8 bit */
+	if (o->flags & OP_MOV) {
+		ParseR8Pair(&l, &r);
+		ir.sr[i] = r;
+		ir.dr[i] = l;
+	}
+	/* Immediate to register move, 8bit */
+	if (o->flags & OP_MVI) {
+		ParseR8Const(&l, &r);
+		ir.dr[i] = l;
+		ir.addrconst[i] = r;
+	}
+	/* General immediates */
+	if (o->flags & OP_IMMED) {
+		/* 16bit source/destinations eg lxi */
+		if (o->flags & (OP_SPAIR | OP_DPAIR)) {
+			ParsePairConst(&l, &r, &ir.sym[i], &ir.symoff[i]);
+			if (o->flags & OP_SPAIR)
+				ir.sr[i] = l;
+			else
+				ir.dr[i] = l;
+			ir.addrconst[i] = r;
+		}
+		/* Arithmetic/logic op 8bit with immediate */
+		if (o->flags & OP_AOP) {
+			ParseConst(&l);
+			/* This is a simplification. Strictly speaking AND 0, XOR 0 and
+			   OR 0xFF don't need the sr */
+			ir.sr[i] = ir.dr[i] = REG_A;
+			ir.addrconst[i] = l;
+		}
+	} else {
+		/* reg pair as destination eg pop b */
+		if (o->flags & OP_DPAIR) {
+			ParsePair(&l);
+			ir.dr[i] = l;
+		}
+		/* reg pair as source - eg push b */
+		else if (o->flags & OP_SPAIR) {
+			ParsePair(&l);
+			ir.sr[i] = l;
+			/* DAD has an implicit destination */
+			if (o->alu == ALU_DAD)
+				ir.dr[i] = REG_H;
+		}
+		/* Arithmetic op without constant */
+		else if (o->flags & OP_AOP) {
+			ParseR8M(&l);
+			ir.dr[i] = REG_A;
+			ir.sr[i] = l;
+		}
+	}
+	/* Offset from HL or SP into DE - eg ldsi 4 */
+	if (o->flags & OP_OFF8) {
+		ParseConst(&l);
+		ir.addrconst[i] = l;
+	}
+	/* Register modify - eg inr a */
+	if (o->flags & OP_REGMOD) {
+		ParseR8M(&l);
+		ir.dr[i] = ir.sr[i] = l;
+	}
+	/* Pair modify - eg inx b */
+	if (o->flags & OP_PAIRMOD) {
+		ParsePair(&l);
+		ir.dr[i] = ir.sr[i] = l;
+	}
+	/* Address target, unless it was given by a pair (LDAX/STAX) */
+	if ((o->flags & (OP_ADDR | OP_SPAIR)) == OP_ADDR) {
+		ParseAddr(&l, &ir.sym[i], &ir.symoff[i]);
+		/* But do nothing with it yet */
+		ir.addrconst[i] = l;
+	}
+	/* Jump and call targets */
+	if ((o->flags & (OP_BRA | OP_CALL)) && strcmp(o->op, "PCHL")) {
+		ParseAddr(&l, &ir.sym[i], &ir.symoff[i]);
+		ir.addrconst[i] = l;
+	}
+	compute_masks(i);
+	/* For a destination update the constant value */
+	if ((o->flags & OP_IMMED) && (o->flags & OP_DPAIR)
+	    && ir.addrconst[i] != CONST_UNKNOWN)
+		set_pair_value(i, ir.dr[i], ir.addrconst[i]);
+}
+
+
+/*
+ *	Constant evaluation of the ALU. We use the 8085 behaviour where it
+ *	differs from the 8080 (AC after ANA).
+ */
+static uint8_t alu_add(uint8_t a, uint8_t b, int c, uint8_t *f)
+{
+	unsigned int r = a + b + c;
+	*f &= ~(FLAG_CY | FLAG_AC);
+	if (r & 0x100)
+		*f |= FLAG_CY;
+	if (((a & 0x0F) + (b & 0x0F) + c) & 0x10)
+		*f |= FLAG_AC;
+	return r;
+}
+
+static void alu_szp(uint8_t r, uint8_t *f)
+{
+	uint8_t p = r ^ (r >> 4);
+	p ^= p >> 2;
+	p ^= p >> 1;
+	*f &= ~(FLAG_S | FLAG_Z | FLAG_P);
+	if (r & 0x80)
+		*f |= FLAG_S;
+	if (r == 0)
+		*f |= FLAG_Z;
+	if (!(p & 1))
+		*f |= FLAG_P;
+}
+
+/* Evaluate an 8bit operation on A (or the INR/DCR register) and the
+   source, updating the flags in *f */
+static uint8_t alu_eval(int alu, uint8_t a, uint8_t b, uint8_t *f)
+{
+	int cy = *f & FLAG_CY;
+	uint8_t r = a;
+	uint8_t t;
+
+	switch (alu) {
+	case ALU_ADD:
+		r = alu_add(a, b, 0, f);
+		break;
+	case ALU_ADC:
+		r = alu_add(a, b, cy, f);
+		break;
+	case ALU_SUB:
+	case ALU_CMP:
+		r = alu_add(a, ~b, 1, f);
+		*f ^= FLAG_CY;
+		break;
+	case ALU_SBB:
+		r = alu_add(a, ~b, !cy, f);
+		*f ^= FLAG_CY;
+		break;
+	case ALU_AND:
+		r = a & b;
+		*f = (*f & ~FLAG_CY) | FLAG_AC;
+		break;
+	case ALU_XOR:
+		r = a ^ b;
+		*f &= ~(FLAG_CY | FLAG_AC);
+		break;
+	case ALU_OR:
+		r = a | b;
+		*f &= ~(FLAG_CY | FLAG_AC);
+		break;
+	case ALU_INR:
+	case ALU_DCR:
+		t = *f;
+		r = alu_add(a, alu == ALU_INR ? 1 : 0xFF, 0, f);
+		*f = (*f & ~FLAG_CY) | (t & FLAG_CY);
+		break;
+	case ALU_RLC:
+		r = (a << 1) | (a >> 7);
+		*f = (*f & ~FLAG_CY) | (a >> 7);
+		return r;
+	case ALU_RRC:
+		r = (a >> 1) | (a << 7);
+		*f = (*f & ~FLAG_CY) | (a & 1);
+		return r;
+	case ALU_RAL:
+		r = (a << 1) | cy;
+		*f = (*f & ~FLAG_CY) | (a >> 7);
+		return r;
+	case ALU_RAR:
+		r = (a >> 1) | (cy << 7);
+		*f = (*f & ~FLAG_CY) | (a & 1);
+		return r;
+	case ALU_CMA:
+		return ~a;
+	case ALU_DAA:
+		t = 0;
+		if ((a & 0x0F) > 9 || (*f & FLAG_AC))
+			t |= 0x06;
+		if ((a >> 4) > 9 || cy || ((a >> 4) >= 9 && (a & 0x0F) > 9)) {
+			t |= 0x60;
+			cy = 1;
+		}
+		r = alu_add(a, t, 0, f);
+		*f = (*f & ~FLAG_CY) | cy;
+		break;
+	case ALU_STC:
+		*f |= FLAG_CY;
+		return a;
+	case ALU_CMC:
+		*f ^= FLAG_CY;
+		return a;
+	}
+	alu_szp(r, f);
+	/* Compare doesn't keep the result */
+	if (alu == ALU_CMP)
+		return a;
+	return r;
+}
+
+static void set_flag(unsigned int e, uint8_t flag, int v)
+{
+	ir.fknown[e] |= flag;
+	if (v)
+		ir.fvalue[e] |= flag;
+	else
+		ir.fvalue[e] &= ~flag;
+}
+
+/* Sign and zero follow the result whenever we know enough of it */
+static void flags_from_bits(unsigned int e, struct regbits *r)
+{
+	if (bits_known(r) || bits_nonzero(r))
+		set_flag(e, FLAG_Z, bits_known(r) && r->one == 0);
+	if ((r->zero | r->one) & 0x80)
+		set_flag(e, FLAG_S, r->one & 0x80);
+}
+
+/* Forget the flags the target doesn't set the way the 8085 does */
+static void target_flags(unsigned int i)
+{
+	int alu = OPINFO(i)->alu;
+
+	if ((ctx->cpu->fdiff & FD_ANA_AC) && alu == ALU_AND)
+		ir.fknown[i] &= ~FLAG_AC;
+	if (!(ctx->cpu->fdiff & FD_Z80))
+		return;
+	if (alu == ALU_ADD || alu == ALU_ADC || alu == ALU_SUB
+	    || alu == ALU_SBB || alu == ALU_CMP || alu == ALU_INR
+	    || alu == ALU_DCR)
+		ir.fknown[i] &= ~FLAG_P;
+	if ((alu >= ALU_RLC && alu <= ALU_CMA) || alu == ALU_STC
+	    || alu == ALU_CMC || alu == ALU_DAD)
+		ir.fknown[i] &= ~FLAG_AC;
+}
+
+/*
+ *	Work out the result and flags of an ALU operation. If everything it
+ *	depends on is known we just run it, otherwise we work with the known
+ *	bits and ranges.
+ */
+static void compute_alu(unsigned int i)
+{
+	struct optab *o = OPINFO(i);
+	unsigned int p = ir.prev[i];
+	int alu = o->alu;
+	int r = REG_A;
+	uint8_t fk = ir.fknown[p];
+	int cin = (fk & FLAG_CY) ? (ir.fvalue[p] & FLAG_CY) : -1;
+	struct regbits src, a, *res;
+
+	/* The flags we change are unknown until we work them out */
+	ir.fknown[i] = fk & ~alu_fset[alu];
+	ir.fvalue[i] = ir.fvalue[p] & ir.fknown[i];
+
+	/* 16bit operations */
+	if (alu == ALU_INX || alu == ALU_DCX) {
+		if (know_pair_value(p, ir.dr[i]))
+			set_pair_value(i, ir.dr[i], pair_value(p, ir.dr[i]) +
+				       (alu == ALU_INX ? 1 : -1));
+		return;
+	}
+	if (alu == ALU_DAD) {
+		if (know_pair_value(p, REG_H) && know_pair_value(p, ir.sr[i])) {
+			unsigned int v = pair_value(p, REG_H) +
+					 pair_value(p, ir.sr[i]);
+			set_pair_value(i, REG_H, v);
+			set_flag(i, FLAG_CY, v & 0x10000);
+		}
+		return;
+	}
+	/* The undocumented ones. We only trust the carry they leave */
+	if (alu == ALU_DSUB) {
+		if (know_pair_value(p, REG_H) && know_pair_value(p, REG_B)) {
+			unsigned int v = pair_value(p, REG_H) -
+					 pair_value(p, REG_B);
+			set_pair_value(i, REG_H, v);
+			set_flag(i, FLAG_CY, v & 0x10000);
+		}
+		return;
+	}
+	if (alu == ALU_ARHL) {
+		if (know_pair_value(p, REG_H)) {
+			uint16_t v = pair_value(p, REG_H);
+			set_pair_value(i, REG_H, (v >> 1) | (v & 0x8000));
+			set_flag(i, FLAG_CY, v & 1);
+		}
+		return;
+	}
+	if (alu == ALU_RDEL) {
+		if (know_pair_value(p, REG_D) && cin != -1) {
+			uint16_t v = pair_value(p, REG_D);
+			set_pair_value(i, REG_D, (v << 1) | !!cin);
+			set_flag(i, FLAG_CY, v & 0x8000);
+		}
+		return;
+	}
+
+	if (alu == ALU_INR || alu == ALU_DCR)
+		r = ir.dr[i];
+	/* Operations on M we can't follow */
+	if (r > REG_L)
+		return;
+	a = *reg_bits(p, r);
+	res = reg_bits(i, r);
+
+	if (alu == ALU_INR || alu == ALU_DCR)
+		bits_const(&src, alu == ALU_INR ? 0x01 : 0xFF);
+	else if (o->flags & OP_IMMED) {
+		if (ir.addrconst[i] == CONST_UNKNOWN)
+			bits_unknown(&src);
+		else
+			bits_const(&src, ir.addrconst[i]);
+	} else if ((o->flags & OP_AOP) && ir.sr[i] > REG_L)
+		bits_unknown(&src);
+	else if (o->flags & OP_AOP)
+		src = *reg_bits(p, ir.sr[i]);
+	else
+		bits_const(&src, 0);
+
+	/* XRA A, SUB A, CMP A and SBB A don't care what A was so work them
+	   out as if it was zero */
+	if ((o->flags & OP_AOP) && ir.sr[i] == REG_A && !(o->flags & OP_IMMED)
+	    && (alu == ALU_XOR || alu == ALU_SUB || alu == ALU_CMP
+		|| alu == ALU_SBB)) {
+		bits_const(&a, 0);
+		bits_const(&src, 0);
+	}
+
+	/* Everything is known so just run it */
+	if (bits_known(&a) && bits_known(&src)
+	    && (fk & alu_fuse[alu]) == alu_fuse[alu]) {
+		uint8_t f = ir.fvalue[p];
+		uint8_t v = alu_eval(alu, a.one, src.one, &f);
+		set_reg_value(i, r, v);
+		ir.fknown[i] |= alu_fset[alu];
+		ir.fvalue[i] = (ir.fvalue[i] & ~alu_fset[alu]) |
+			       (f & alu_fset[alu]);
+		return;
+	}
+
+	switch (alu) {
+	case ALU_ADD:
+		bits_add(res, &a, &src, 0);
+		break;
+	case ALU_ADC:
+		bits_add(res, &a, &src, cin);
+		break;
+	case ALU_SUB:
+		bits_sub(res, &a, &src, 0);
+		break;
+	case ALU_SBB:
+		bits_sub(res, &a, &src, cin);
+		break;
+	case ALU_INR:
+	case ALU_DCR:
+		bits_add(res, &a, &src, 0);
+		break;
+	case ALU_AND:
+		bits_and(res, &a, &src);
+		break;
+	case ALU_OR:
+		bits_or(res, &a, &src);
+		break;
+	case ALU_XOR:
+		bits_xor(res, &a, &src);
+		break;
+	case ALU_CMP:
+		/* Disjoint ranges still tell us the answer */
+		if (a.hi < src.lo || a.lo > src.hi) {
+			set_flag(i, FLAG_Z, 0);
+			set_flag(i, FLAG_CY, a.hi < src.lo);
+		}
+		return;
+	case ALU_RLC:
+	case ALU_RAL:
+		if (alu == ALU_RLC && ((a.zero | a.one) & 0x80))
+			cin = !!(a.one & 0x80);
+		else if (alu == ALU_RLC)
+			cin = -1;
+		bits_rotate(res, &a, 1, cin);
+		if ((a.zero | a.one) & 0x80)
+			set_flag(i, FLAG_CY, a.one & 0x80);
+		return;
+	case ALU_RRC:
+	case ALU_RAR:
+		if (alu == ALU_RRC && ((a.zero | a.one) & 0x01))
+			cin = a.one & 0x01;
+		else if (alu == ALU_RRC)
+			cin = -1;
+		bits_rotate(res, &a, 0, cin);
+		if ((a.zero | a.one) & 0x01)
+			set_flag(i, FLAG_CY, a.one & 0x01);
+		return;
+	case ALU_CMA:
+		bits_not(res, &a);
+		return;
+	default:
+		/* DAA, STC and CMC without enough to go on */
+		return;
+	}
+	/* Logic operations always clear the carry */
+	if (alu == ALU_AND || alu == ALU_OR || alu == ALU_XOR) {
+		set_flag(i, FLAG_CY, 0);
+		set_flag(i, FLAG_AC, alu == ALU_AND);
+	}
+	flags_from_bits(i, res);
+}
+
+/*
+ *	Compute the actual register effects of an instruction
+ */
+static void compute_effects(unsigned int i)
+{
+	const char *op = OPINFO(i)->op;
+	int n;
+
+	ir_touch(i);
+	/* Anything we set starts off unknown, the rest passes through */
+	for (n = REG_A; n <= REG_L; n++) {
+		if (ir.set[i] & (1 << n))
+			clear_reg_value(i, n);
+		else
+			copy_reg_bits(i, n, ir.prev[i], n);
+	}
+	if (ir.set[i] & REGM_PSW)
+		ir.fknown[i] = 0;
+	else {
+		ir.fknown[i] = ir.fknown[ir.prev[i]];
+		ir.fvalue[i] = ir.fvalue[ir.prev[i]];
+	}
+
+	if (OPINFO(i)->flags & OP_MOV)
+		copy_reg_bits(i, ir.dr[i], ir.prev[i], ir.sr[i]);
+	if ((OPINFO(i)->flags & OP_MVI) && ir.addrconst[i] != CONST_UNKNOWN)
+		set_reg_value(i, ir.dr[i], ir.addrconst[i]);
+	if ((OPINFO(i)->flags & OP_IMMED) && !(OPINFO(i)->flags & OP_AOP)) {
+		if (ir.addrconst[i] != CONST_UNKNOWN)
+			set_pair_value(i, ir.dr[i], ir.addrconst[i]);
+		else if (ir.sym[i] && ir.dr[i] != REG_SP)
+			set_pair_sym(i, ir.dr[i], ir.sym[i], ir.symoff[i]);
+	}
+	/*
+	 *	Follow the pair on the top of the stack so that a POP gets the
+	 *	value numbers of what was pushed. Anything else that moves SP
+	 *	loses track, apart from XTHL which swaps it with HL, and so does
+	 *	any store or call as it may write over the pushed pair.
+	 */
+	if (strcasecmp(op, "PUSH") == 0) {
+		int r = ir.sr[i] == REG_PSW ? REG_A : ir.sr[i];
+		ir.tos[i][0] = ir.vn[ir.prev[i]][r];
+		ir.tos[i][1] = ir.sr[i] == REG_PSW ? 0 : ir.vn[ir.prev[i]][r + 1];
+	} else if (strcasecmp(op, "POP") == 0) {
+		int r = ir.dr[i] == REG_PSW ? REG_A : ir.dr[i];
+		if (ir.tos[ir.prev[i]][0])
+			ir.vn[i][r] = ir.tos[ir.prev[i]][0];
+		if (ir.dr[i] != REG_PSW && ir.tos[ir.prev[i]][1])
+			ir.vn[i][r + 1] = ir.tos[ir.prev[i]][1];
+		ir.tos[i][0] = ir.tos[i][1] = 0;
+	} else if (strcasecmp(op, "XTHL") == 0) {
+		ir.tos[i][0] = ir.vn[ir.prev[i]][REG_H];
+		ir.tos[i][1] = ir.vn[ir.prev[i]][REG_L];
+		if (ir.tos[ir.prev[i]][0])
+			ir.vn[i][REG_H] = ir.tos[ir.prev[i]][0];
+		if (ir.tos[ir.prev[i]][1])
+			ir.vn[i][REG_L] = ir.tos[ir.prev[i]][1];
+	} else if (ir.set[i] & (REGM_SP | MEMORYM | MEMM_HL))
+		ir.tos[i][0] = ir.tos[i][1] = 0;
+	else {
+		ir.tos[i][0] = ir.tos[ir.prev[i]][0];
+		ir.tos[i][1] = ir.tos[ir.prev[i]][1];
+	}
+
+	/* XCHG swaps what we know along with the registers */
+	if (strcasecmp(op, "XCHG") == 0) {
+		copy_reg_bits(i, REG_D, ir.prev[i], REG_H);
+		copy_reg_bits(i, REG_E, ir.prev[i], REG_L);
+		copy_reg_bits(i, REG_H, ir.prev[i], REG_D);
+		copy_reg_bits(i, REG_L, ir.prev[i], REG_E);
+	}
+	/* LDHI sets DE to HL plus the offset */
+	if (strcasecmp(op, "LDHI") == 0 && know_pair_value(ir.prev[i], REG_H)
+	    && ir.addrconst[i] != CONST_UNKNOWN)
+		set_pair_value(i, REG_D, pair_value(ir.prev[i], REG_H) +
+			       ir.addrconst[i]);
+
+	/* Calculate the stack/frame offset. It carries on from the last
+	   instruction. Popping more than we pushed means we are taking
+	   apart our caller's frame and we stop tracking */
+	ir.spbias[i] = ir.spbias[ir.prev[i]];
+	if (strcasecmp(op, "PUSH") == 0)
+		if (ir.spbias[i] != BIAS_UNKNOWN)
+			ir.spbias[i] += 2;
+	if (strcasecmp(op, "POP") == 0) {
+		if (ir.spbias[i] != BIAS_UNKNOWN)
+			ir.spbias[i] -= 2;
+		if (ir.spbias[i] < 0)
+			ir.spbias[i] = BIAS_UNKNOWN;
+	}
+	if (strcasecmp(op, "INX") == 0 && ir.dr[i] == REG_SP) {
+		if (ir.spbias[i] != BIAS_UNKNOWN)
+			ir.spbias[i]--;
+	}
+	if ((strcasecmp(op, "DEX") == 0 || strcasecmp(op, "DCX") == 0)
+	    && ir.dr[i] == REG_SP) {
+		if (ir.spbias[i] != BIAS_UNKNOWN)
+			ir.spbias[i]++;
+	}
+	/*
+	 *  HL may point into the frame. We keep it as an offset from the SP
+	 *  we were entered with so it holds across pushes and pops. It comes
+	 *  from LXI H,nn; DAD SP and lets us follow the stack pointer being
+	 *  adjusted by LXI H,nn; DAD SP; SPHL
+	 */
+	ir.flags[i] &= ~HL_SPBIAS;
+	if (strcasecmp(op, "DAD") == 0 && ir.sr[i] == REG_SP) {
+		if (know_pair_value(ir.prev[i], REG_H)
+		    && ir.spbias[ir.prev[i]] != BIAS_UNKNOWN) {
+			ir.flags[i] |= HL_SPBIAS;
+			/* 16bit signed */
+			ir.hlbias[i] = (int16_t)pair_value(ir.prev[i], REG_H)
+				- ir.spbias[ir.prev[i]];
+		}
+	} else if (ir.flags[ir.prev[i]] & HL_SPBIAS) {
+		int32_t b = ir.hlbias[ir.prev[i]];
+		if ((OPINFO(i)->flags & OP_PAIRMOD) && ir.dr[i] == REG_H) {
+			ir.flags[i] |= HL_SPBIAS;
+			ir.hlbias[i] = b + (strcasecmp(op, "INX") ? -1 : 1);
+		} else if (!(ir.iset[i] & (REGM_H | REGM_L))) {
+			ir.flags[i] |= HL_SPBIAS;
+			ir.hlbias[i] = b;
+		}
+	}
+	if (strcasecmp(op, "SPHL") == 0) {
+		if (ir.flags[ir.prev[i]] & HL_SPBIAS)
+			ir.spbias[i] = -ir.hlbias[ir.prev[i]];
+		else
+			ir.spbias[i] = BIAS_UNKNOWN;
+	}
+
+	/* General operation tracking. Simple for now as we don't try to tackle
+	   flag, stack, label or memory tracking at all */
+
+	if (OPINFO(i)->alu) {
+		compute_alu(i);
+		target_flags(i);
+	}
+
+	if ((OPINFO(i)->flags & OP_PAIRMOD) && ir.dr[i] != REG_SP
+	    && know_pair_sym(ir.prev[i], ir.dr[i])) {
+		struct regsym *s = reg_sym(ir.prev[i], ir.dr[i]);
+		set_pair_sym(i, ir.dr[i], s->sym,
+			     s->off + (strcasecmp(op, "INX") ? -1 : 1));
+	}
+	/* Symbol plus a constant is still a symbol */
+	if (strcasecmp(op, "DAD") == 0 && ir.sr[i] != REG_SP) {
+		if (know_pair_sym(ir.prev[i], REG_H)
+		    && know_pair_value(ir.prev[i], ir.sr[i]))
+			set_pair_sym(i, REG_H, reg_sym(ir.prev[i], REG_H)->sym,
+				     reg_sym(ir.prev[i], REG_H)->off +
+				     pair_value(ir.prev[i], ir.sr[i]));
+		if (know_pair_value(ir.prev[i], REG_H)
+		    && know_pair_sym(ir.prev[i], ir.sr[i]))
+			set_pair_sym(i, REG_H, reg_sym(ir.prev[i], ir.sr[i])->sym,
+				     reg_sym(ir.prev[i], ir.sr[i])->off +
+				     pair_value(ir.prev[i], REG_H));
+	}
+}
+
+/* Does anything arrive at i other than from the instruction before */
+static int entry_point(unsigned int i)
+{
+	return ir.label[i] || (OPINFO(ir.prev[i])->flags & OP_DATA);
+}
+
+static void compute_point(unsigned int i)
+{
+	int n;
+	/* We assume everything at a label is unknown because we can't know
+	   the callers, and the same after data */
+	if (entry_point(i)) {
+		ir_touch(ir.prev[i]);
+		invalidate_regs(ir.prev[i]);
+	}
+	compute_effects(i);
+	if (!entry_point(i)) {
+		/* Propagate known values */
+		for (n = REG_A; n <= REG_L; n++) {
+			if (!(ir.set[i] & (1 << n)))
+				copy_reg_bits(i, n, ir.prev[i], n);
+			/* Worth debug checks here if ir.set[i] is clear but value
+			   already known as it shouldn't happen ?? */
+		}
+	}
+}
+
+static void compute_values(void)
+{
+	unsigned int i;
+
+	for (i = ir.next[0]; i; i = ir.next[i])
+		compute_point(i);
+	analysed = 1;
+}
+
+/*
+ *	Keeping the analysis up to date as we edit. A change at an
+ *	instruction is carried forward through the values and back through
+ *	the needs until they come out as they were, which is usually within
+ *	a few instructions as a label starts afresh. Value numbers are only
+ *	ever compared at one point, so numbers that are shared out the same
+ *	way count as the same and we keep the old ones there for the code
+ *	after to go on using.
+ */
+struct point {
+	struct regbits bits[8];
+	struct regsym syms[8];
+	uint32_t vn[10];	/* The registers then the stack top */
+	uint8_t fknown;
+	uint8_t fvalue;
+	uint8_t flags;
+	int32_t hlbias;
+	int32_t spbias;
+};
+
+static void save_point(struct point *p, unsigned int i)
+{
+	memcpy(p->bits, ir.bits[i], sizeof(p->bits));
+	memcpy(p->syms, ir.syms[i], sizeof(p->syms));
+	memcpy(p->vn, ir.vn[i], 8 * sizeof(uint32_t));
+	memcpy(p->vn + 8, ir.tos[i], 2 * sizeof(uint32_t));
+	p->fknown = ir.fknown[i];
+	p->fvalue = ir.fvalue[i];
+	p->flags = ir.flags[i];
+	p->hlbias = ir.hlbias[i];
+	p->spbias = ir.spbias[i];
+}
+
+static int same_point(struct point *p, unsigned int i)
+{
+	uint32_t vn[10];
+	unsigned int a, b;
+
+	for (a = 0; a < 8; a++) {
+		struct regbits *x = &p->bits[a], *y = &ir.bits[i][a];
+		struct regsym *s = &p->syms[a], *t = &ir.syms[i][a];
+		if (x->zero != y->zero || x->one != y->one || x->lo != y->lo
+		    || x->hi != y->hi)
+			return 0;
+		if (s->sym != t->sym || s->off != t->off || s->high != t->high)
+			return 0;
+	}
+	if (p->fknown != ir.fknown[i]
+	    || ((p->fvalue ^ ir.fvalue[i]) & p->fknown)
+	    || p->flags != ir.flags[i] || p->spbias != ir.spbias[i])
+		return 0;
+	if ((p->flags & HL_SPBIAS) && p->hlbias != ir.hlbias[i])
+		return 0;
+	memcpy(vn, ir.vn[i], 8 * sizeof(uint32_t));
+	memcpy(vn + 8, ir.tos[i], 2 * sizeof(uint32_t));
+	for (a = 0; a < 10; a++) {
+		if (!vn[a] != !p->vn[a])
+			return 0;
+		for (b = a + 1; b < 10; b++)
+			if ((vn[a] == vn[b]) != (p->vn[a] == p->vn[b]))
+				return 0;
+	}
+	return 1;
+}
+
+/* Something at or before i changed what we know at i */
+static void update_values(unsigned int i)
+{
+	struct point old;
+
+	for (; i; i = ir.next[i]) {
+		save_point(&old, i);
+		compute_point(i);
+		if (same_point(&old, i)) {
+			memcpy(ir.vn[i], old.vn, 8 * sizeof(uint32_t));
+			memcpy(ir.tos[i], old.vn + 8, 2 * sizeof(uint32_t));
+			return;
+		}
+	}
+}
+
+/* What is needed before i, as propagate_need() and compute_values()
+   leave it */
+static uint32_t need_in(unsigned int i)
+{
+	if (entry_point(i))
+		return REGM_ALL;
+	return ir.ineed[i] | need_past(i);
+}
+
+/* What i needs has changed. Carry it back */
+static void update_need(unsigned int i)
+{
+	unsigned int p;
+
+	for (;;) {
+		p = ir.prev[i];
+		ir_touch(p);
+		ir.need[p] = need_in(i);
+		if (p == 0 || need_in(p) == ir.need[ir.prev[p]])
+			return;
+		i = p;
+	}
+}
+
+/* Instruction i has been rewritten or added */
+static void reanalyse(unsigned int i)
+{
+	if (!analysed)
+		return;
+	update_values(i);
+	update_need(i);
+}
+
+static void make_op(unsigned int i, const char *m)
+{
+	char *p = zalloc(8);
+
+	ir_touch(i);
+	ir.oplen[i] = sprintf(p, "%s %c,%c", m, regname(ir.dr[i]), regname(ir.sr[i]));
+	ir.op[i] = p;
+	ir.opcode[i] = find_operation(m) - ops;
+	compute_masks(i);
+	reanalyse(i);
+}
+
+static void make_op1(unsigned int i, const char *m)
+{
+	char *p = zalloc(8);
+
+	ir_touch(i);
+	ir.oplen[i] = sprintf(p, "%s %c", m, regname(ir.dr[i]));
+	ir.op[i] = p;
+	ir.opcode[i] = find_operation(m) - ops;
+	compute_masks(i);
+	reanalyse(i);
+}
+
+static void make_op2_r(unsigned int i, const char *m, int rd, int rs)
+{
+	char *p = zalloc(8);
+
+	ir_touch(i);
+	ir.oplen[i] = sprintf(p, "%s %c,%c", m, regname(rd), regname(rs));
+	ir.op[i] = p;
+	ir.opcode[i] = find_operation(m) - ops;
+	ir.dr[i] = rd;
+	ir.sr[i] = rs;
+	compute_masks(i);
+	reanalyse(i);
+}
+
+/* Change the operation keeping the operands, eg for branches */
+static void rename_op(unsigned int i, const char *m)
+{
+	const char *p = ir.op[i];
+	const char *e = p + ir.oplen[i];
+	char *n;
+
+	ir_touch(i);
+	while (p < e && !isspace(*p))
+		p++;
+	n = zalloc(strlen(m) + (e - p) + 1);
+	ir.oplen[i] = sprintf(n, "%s%.*s", m, (int)(e - p), p);
+	ir.op[i] = n;
+	ir.opcode[i] = find_operation(m) - ops;
+	compute_masks(i);
+	reanalyse(i);
+}
+
+/* Add an instruction after i. The values and needs are brought up to
+   date by the make_op helpers */
+static unsigned int add_op1(unsigned int i, const char *m)
+{
+	unsigned int n = append_instruction(i);
+	/* Same operand as the instruction before */
+	ir.dr[n] = ir.sr[n] = ir.dr[i];
+	make_op1(n, m);
+	return n;
+}
+
+static unsigned int add_op2_r(unsigned int i, const char *m, int rd, int rs)
+{
+	unsigned int n = append_instruction(i);
+	make_op2_r(n, m, rd, rs);
+	return n;
+}
+
+static void eliminate_instruction(unsigned int i)
+{
+	trace("Eliminate %u %u\n", i, ir.prev[i]);
+	ir_touch(i);
+	ir_touch(ir.prev[i]);
+
+	/* A labelled instruction leaves the label behind on its own */
+	if (ir.label[i]) {
+		trace("Eliminating %.*s\n", ir.oplen[i], ir.op[i]);
+		ir.op[i] = "";
+		ir.oplen[i] = 0;
+		parse_instruction(i);
+		ir.sr[i] = ir.dr[i] = 0;
+		ir.sym[i] = ir.symoff[i] = 0;
+		ir.addrconst[i] = 0;
+		ir.ineed[i] = 0;
+		ir.iset[i] = ir.set[i] = SIDEEFFECTM;
+		ir.need[ir.prev[i]] = ir.need[i];
+		reanalyse(i);
+		return;
+	}
+
+	/* Unlink ourself but keep our own links valid so a pass can carry
+	   on walking from us */
+	ir_unlink(i);
+
+	trace("Eliminating %.*s\n", ir.oplen[i], ir.op[i]);
+	ir.iset[i] = 0;
+	ir.dead[i] = 1;
+	ir.need[ir.prev[i]] = ir.need[i];
+	/* We are now a do nothing */
+	ir.set[i] = 0;
+	/* What we set is now whatever came before */
+	if (analysed) {
+		update_values(ir.next[i]);
+		if (ir.prev[i])
+			update_need(ir.prev[i]);
+	}
+}
+
+/* We should do this for all the 8bit immediates. We don't bother looking
+   for mov a,0 because the compiler is smart enough already */
+static void adjust_immed8(void)
+{
+	unsigned int i = ir.next[0];
+	int r;
+	while (i) {
+		int kdr = know_reg_value(ir.prev[i], ir.dr[i]);
+		/* Remove anybody who loads a preloaded value */
+		/* Use icr/dcr otherwise - should be safe but needs review
+		   of compiler rules. We might need to flag this with
+		   a PSW check but I don't think ack generates delayed
+		   conditionals this way */
+		if ((OPINFO(i)->flags & OP_MVI) && kdr) {
+			uint8_t v = reg_value(ir.prev[i], ir.dr[i]);
+			int step = !(ir.need[i] & REGM_PSW) &&
+			    cost_op(find_operation("INR"), ir.dr[i]) <= cost(i);
+			if (v == (uint8_t)ir.addrconst[i])
+				eliminate_instruction(i);
+			else if (step && v == (uint8_t)(ir.addrconst[i] + 1))
+				make_op1(i, "DCR");
+			else if (step && v == (uint8_t)(ir.addrconst[i] - 1))
+				make_op1(i, "INR");
+		}
+		/* Moves of values already present are done by
+		   eliminate_copies() */
+		if (OPINFO(i)->flags & OP_MOV)
+			;
+		/* For each 8bit operation with an immediate source look to see if
+		   we can find the value lurking in a register. For 0, 1 and 255 at
+		   least it's got a fair chance of being there somewhere */
+		else if (((OPINFO(i)->flags & (OP_IMMED | OP_AOP)) ==
+		     (OP_IMMED | OP_AOP)) || (OPINFO(i)->flags & OP_MVI)) {
+//			printf("Candidate %s want %d\n", ir.op[i],
+//			       ir.addrconst[i]);
+			r = find_reg_value(ir.prev[i], ir.addrconst[i]);
+			if (r && cost_op(OPINFO(i) - 1, ir.dr[i]) <= cost(i)) {
+				ir.sr[i] = r;
+				/* Convert to normal op from immediate */
+				ir.opcode[i]--;
+				make_op(i, OPINFO(i)->op);
+			}
+		}
+		i = ir.next[i];
+	}
+}
+
+/*
+ *	Use what we know about individual bits. A mask that can't change A
+ *	is only there for the flags, and flags we know decide the conditional
+ *	jump, call or return after them. As in adjust_immed8()
+ *	we assume ack doesn't generate delayed conditionals so once the branch
+ *	is decided a flag only operation feeding it can go too.
+ */
+static int flags_only(unsigned int i)
+{
+	const char *op = OPINFO(i)->op;
+	struct regbits *a = reg_bits(ir.prev[i], REG_A);
+	uint8_t k = ir.addrconst[i];
+
+	if ((strcmp(op, "ANA") == 0 || strcmp(op, "ORA") == 0)
+	    && ir.sr[i] == REG_A)
+		return 1;
+	if (ir.addrconst[i] == CONST_UNKNOWN)
+		return 0;
+	/* Every bit the mask clears is already zero */
+	if (strcmp(op, "ANI") == 0 && (uint8_t)(a->zero | k) == 0xFF)
+		return 1;
+	/* Every bit the mask sets is already one */
+	if (strcmp(op, "ORI") == 0 && (k & ~a->one) == 0)
+		return 1;
+	return 0;
+}
+
+/* The condition codes and the flag they test */
+static const struct {
+	const char *cc;
+	uint8_t flag;
+	uint8_t set;
+} conds[] = {
+	{ "NZ", FLAG_Z, 0 }, { "Z", FLAG_Z, 1 },
+	{ "NC", FLAG_CY, 0 }, { "C", FLAG_CY, 1 },
+	{ "PO", FLAG_P, 0 }, { "PE", FLAG_P, 1 },
+	{ "P", FLAG_S, 0 }, { "M", FLAG_S, 1 },
+	{ NULL, }
+};
+
+/* Work out if a conditional branch, call or return is always taken (1),
+   never taken (0) or we don't know (-1) from the flags before it */
+static int branch_taken(unsigned int e, unsigned int n)
+{
+	const char *op = OPINFO(n)->op;
+	int i;
+
+	if (!(OPINFO(n)->flags & (OP_BRA | OP_CALL | OP_RET)))
+		return -1;
+	for (i = 0; conds[i].cc; i++) {
+		if (strcmp(op + 1, conds[i].cc))
+			continue;
+		if (!(ir.fknown[e] & conds[i].flag))
+			return -1;
+		return !(ir.fvalue[e] & conds[i].flag) == !conds[i].set;
+	}
+	return -1;
+}
+
+static void simplify_bits(void)
+{
+	unsigned int i = ir.next[0];
+	while (i) {
+		unsigned int n = ir.next[i];
+		int taken = -1;
+
+		/* Decide a conditional straight after us */
+		if (n && ir.label[n] == NULL)
+			taken = branch_taken(i, n);
+		if (taken == 1) {
+			if (OPINFO(n)->flags & OP_BRA)
+				rename_op(n, "JMP");
+			else if (OPINFO(n)->flags & OP_CALL)
+				rename_op(n, "CALL");
+			else
+				rename_op(n, "RET");
+		} else if (taken == 0) {
+			eliminate_instruction(n);
+			n = ir.next[i];
+		}
+		if (flags_only(i)
+		    && (taken != -1 || !(ir.need[i] & REGM_PSW)))
+			eliminate_instruction(i);
+		i = n;
+	}
+}
+
+/*
+ *	An operation whose result we know and whose flags nobody wants can
+ *	become a load. That only pays when it is an immediate operation
+ *	anyway or it lets us drop the load that fed it.
+ */
+static void fold_constants(void)
+{
+	unsigned int i = ir.next[0];
+	while (i) {
+		unsigned int p = ir.prev[i];
+		unsigned int n = ir.next[i];
+		struct optab *o = OPINFO(i);
+		int alu = o->alu;
+		int r = REG_A;
+		unsigned int gain = 0;
+		unsigned int len;
+		char *t;
+
+		if (alu == 0 || alu == ALU_CMP || alu == ALU_STC
+		    || alu == ALU_CMC || alu >= ALU_DSUB
+		    || (ir.need[i] & REGM_PSW)) {
+			i = n;
+			continue;
+		}
+		if (alu == ALU_INR || alu == ALU_DCR || alu == ALU_INX
+		    || alu == ALU_DCX || alu == ALU_DAD)
+			r = ir.dr[i];
+		t = zalloc(16);
+		if (alu == ALU_INX || alu == ALU_DCX || alu == ALU_DAD) {
+			if (r == REG_SP || !know_pair_value(i, r)
+			    || ir.label[i] || p == 0
+			    || strcasecmp(OPINFO(p)->op, "LXI")
+			    || ir.dr[p] != r) {
+				i = n;
+				continue;
+			}
+			len = sprintf(t, "LXI %c,%u", regname(r),
+				      pair_value(i, r));
+			gain = cost(p);
+		} else {
+			if (!know_reg_value(i, r)) {
+				i = n;
+				continue;
+			}
+			/* Either we are an immediate or we can lose the MVI */
+			if (p && ir.label[i] == NULL
+			    && (OPINFO(p)->flags & OP_MVI) && ir.dr[p] == r)
+				gain = cost(p);
+			else if (!(o->flags & OP_IMMED)) {
+				i = n;
+				continue;
+			}
+			len = sprintf(t, "MVI %c,%u", regname(r),
+				      reg_value(i, r));
+		}
+		if (cost_text(t) > cost(i) + gain) {
+			i = n;
+			continue;
+		}
+		ir.op[i] = t;
+		ir.oplen[i] = len;
+		trace("Folding to %.*s\n", ir.oplen[i], ir.op[i]);
+		parse_instruction(i);
+		/* The load we folded into us is no longer used */
+		if (gain)
+			eliminate_instruction(p);
+		i = n;
+	}
+}
+
+/* Replace an instruction with new text */
+static void set_text(unsigned int i, const char *t)
+{
+	char *p = zalloc(strlen(t) + 1);
+
+	ir_touch(i);
+	strcpy(p, t);
+	ir.op[i] = p;
+	ir.oplen[i] = strlen(t);
+	ir.sym[i] = 0;
+	ir.symoff[i] = 0;
+	ir.addrconst[i] = 0;
+	ir.sr[i] = ir.dr[i] = 0;
+	parse_instruction(i);
+	reanalyse(i);
+}
+
+/*
+ *	Runtime helpers for multiplies and shifts. We assume the usual ack
+ *	convention of the left operand in HL and the right in DE with the
+ *	result in HL. Our replacements only ever change DE, A and the flags
+ *	and we check those are dead rather than trusting the helper to
+ *	destroy them. Signed right shifts need ARHL so are only inlined
+ *	for an 8085.
+ */
+#define HELP_MUL	1
+#define HELP_SHL	2
+#define HELP_SHR	3
+#define HELP_SAR	4
+
+static const struct helper {
+	const char *name;
+	int type;
+	unsigned int cycles;	/* Rough time in the helper */
+	unsigned int per;	/* and per bit shifted */
+} helpers[] = {
+	{ ".mli2", HELP_MUL, 700, 0 },
+	{ ".mlu2", HELP_MUL, 700, 0 },
+	{ ".sli2", HELP_SHL, 40, 24 },
+	{ ".slu2", HELP_SHL, 40, 24 },
+	{ ".sru2", HELP_SHR, 40, 40 },
+	{ ".sri2", HELP_SAR, 40, 40 },
+	{ NULL, }
+};
+
+/* Room for the longest, a 15 bit unsigned right shift on an 8080 */
+#define MAX_SEQ		64
+
+static unsigned int seq_cost(const char **seq, unsigned int n)
+{
+	unsigned int c = 0;
+	while (n--)
+		c += cost_text(*seq++);
+	return c;
+}
+
+/* Shift HL left, using byte moves for the first eight */
+static unsigned int seq_shl(const char **seq, unsigned int n, unsigned int c)
+{
+	if (c >= 16) {
+		seq[n++] = "LXI H,0";
+		return n;
+	}
+	if (c >= 8) {
+		seq[n++] = "MOV H,L";
+		seq[n++] = "MVI L,0";
+		c -= 8;
+	}
+	while (c--)
+		seq[n++] = "DAD H";
+	return n;
+}
+
+/* Shift HL right unsigned. Needs A */
+static unsigned int seq_shr(const char **seq, unsigned int n, unsigned int c)
+{
+	unsigned int mask = 0xFF >> (c & 7);
+	char *t;
+
+	if (c >= 16) {
+		seq[n++] = "LXI H,0";
+		return n;
+	}
+	if (c >= 8) {
+		seq[n++] = "MOV L,H";
+		seq[n++] = "MVI H,0";
+		mask = 0xFF;
+		c -= 8;
+	}
+	/* ARHL copies the top bit down so clear the copies afterwards */
+	if (ctx->cpu->ops & OP_8085) {
+		while (c--)
+			seq[n++] = "ARHL";
+		if (mask != 0xFF) {
+			t = zalloc(16);
+			sprintf(t, "ANI %u", mask);
+			seq[n++] = "MOV A,H";
+			seq[n++] = t;
+			seq[n++] = "MOV H,A";
+		}
+		return n;
+	}
+	while (c--) {
+		seq[n++] = "MOV A,H";
+		seq[n++] = "ORA A";
+		seq[n++] = "RAR";
+		seq[n++] = "MOV H,A";
+		seq[n++] = "MOV A,L";
+		seq[n++] = "RAR";
+		seq[n++] = "MOV L,A";
+	}
+	return n;
+}
+
+/* Shift HL right signed. Only for an 8085. Moving the top byte down
+   needs A to make the new top byte */
+static unsigned int seq_sar(const char **seq, unsigned int n, unsigned int c,
+			    int usea)
+{
+	if (c > 15)
+		c = 15;
+	if (c >= 8 && usea) {
+		seq[n++] = "MOV L,H";
+		seq[n++] = "MOV A,H";
+		seq[n++] = "RAL";
+		seq[n++] = "SBB A";
+		seq[n++] = "MOV H,A";
+		c -= 8;
+	}
+	while (c--)
+		seq[n++] = "ARHL";
+	return n;
+}
+
+/* Multiply HL by a constant using DE as the work copy */
+static unsigned int seq_mul(const char **seq, unsigned int n, uint16_t k)
+{
+	unsigned int t = 0;
+	int b;
+
+	if (k == 0) {
+		seq[n++] = "LXI H,0";
+		return n;
+	}
+	while (!(k & 1)) {
+		k >>= 1;
+		t++;
+	}
+	if (k != 1) {
+		seq[n++] = "MOV D,H";
+		seq[n++] = "MOV E,L";
+		for (b = 15; !(k & (1 << b)); b--);
+		while (b--) {
+			seq[n++] = "DAD H";
+			if (k & (1 << b))
+				seq[n++] = "DAD D";
+		}
+	}
+	return seq_shl(seq, n, t);
+}
+
+/*
+ *	Turn multiply and shift helper calls with a constant right hand side
+ *	into inline code when it is cheaper.
+ */
+static void reduce_helpers(void)
+{
+	unsigned int i = ir.next[0];
+	const struct helper *h;
+	const char *seq[MAX_SEQ];
+	char *t;
+
+	while (i) {
+		unsigned int p = ir.prev[i];
+		unsigned int n = ir.next[i];
+		unsigned int len = 0;
+		uint32_t dead = ~ir.need[i];
+		uint16_t k;
+
+		if (strcasecmp(OPINFO(i)->op, "CALL") || ir.sym[i] == 0) {
+			i = n;
+			continue;
+		}
+		for (h = helpers; h->name; h++)
+			if (is_symbol(ir.sym[i], h->name))
+				break;
+		if (h->name == NULL || !know_pair_value(p, REG_D)
+		    || (dead & (REGM_D | REGM_E | REGM_PSW))
+		       != (REGM_D | REGM_E | REGM_PSW)) {
+			i = n;
+			continue;
+		}
+		k = pair_value(p, REG_D);
+		if (know_pair_value(p, REG_H)) {
+			uint16_t v = pair_value(p, REG_H);
+			if (h->type == HELP_MUL)
+				v *= k;
+			else if (h->type == HELP_SAR)
+				v = (int16_t)v >> (k > 15 ? 15 : k);
+			else if (k >= 16)
+				v = 0;
+			else if (h->type == HELP_SHL)
+				v <<= k;
+			else
+				v >>= k;
+			t = zalloc(16);
+			sprintf(t, "LXI H,%u", v);
+			seq[len++] = t;
+		} else if (h->type == HELP_MUL)
+			len = seq_mul(seq, 0, k);
+		else if (h->type == HELP_SHL)
+			len = seq_shl(seq, 0, k);
+		else if (h->type == HELP_SAR && (ctx->cpu->ops & OP_8085))
+			len = seq_sar(seq, 0, k, dead & REGM_A);
+		else if (h->type == HELP_SHR && (dead & REGM_A))
+			len = seq_shr(seq, 0, k);
+		else {
+			i = n;
+			continue;
+		}
+		/* Compare with the call and the time spent in the helper */
+		if (seq_cost(seq, len) <= cost(i) + (h->cycles +
+				h->per * (k & 15)) * ctx->cost_cycles) {
+			unsigned int x = i;
+			unsigned int j;
+			trace("Inlining %.*s\n", ir.oplen[i], ir.op[i]);
+			/* A multiply by one is nothing at all */
+			if (len == 0) {
+				eliminate_instruction(i);
+				i = n;
+				continue;
+			}
+			set_text(i, seq[0]);
+			for (j = 1; j < len; j++) {
+				x = append_instruction(x);
+				set_text(x, seq[j]);
+			}
+		}
+		i = n;
+	}
+}
+
+
+/*
+ *	The undocumented 8085 instructions do in one go what ack writes out
+ *	as runs of byte operations. Each run must be exactly the one we
+ *	know, with nothing jumping into the middle of it.
+ */
+static int op_is(unsigned int i, const char *op, int dr, int sr)
+{
+	return strcmp(OPINFO(i)->op, op) == 0 && ir.dr[i] == dr
+		&& ir.sr[i] == sr;
+}
+
+static unsigned int run_of(unsigned int i, unsigned int *w, unsigned int n)
+{
+	unsigned int k;
+	for (k = 0; k < n; k++) {
+		if (i == 0 || (k && ir.label[i]))
+			return k;
+		w[k] = i;
+		i = ir.next[i];
+	}
+	return n;
+}
+
+/* Frame offsets LDSI can reach */
+static int ldsi_offset(unsigned int i)
+{
+	return op_is(i, "LXI", REG_H, 0) && ir.sym[i] == 0
+		&& ir.addrconst[i] >= 0 && ir.addrconst[i] < 256
+		&& op_is(ir.next[i], "DAD", REG_H, REG_SP)
+		&& ir.label[ir.next[i]] == NULL;
+}
+
+/* Put seq in place of the first n of the run. Returns the last of it */
+static unsigned int swap_run(unsigned int *w, unsigned int n,
+			     const char **seq, unsigned int len)
+{
+	unsigned int k, x;
+
+	for (k = 0; k < n; k++) {
+		if (k < len)
+			set_text(w[k], seq[k]);
+		else
+			eliminate_instruction(w[k]);
+	}
+	x = len ? w[(len < n ? len : n) - 1] : 0;
+	for (; k < len; k++) {
+		x = append_instruction(x);
+		set_text(x, seq[k]);
+	}
+	return x;
+}
+
+/* Swap the first n of the run for seq if that is cheaper */
+static int replace_run(unsigned int *w, unsigned int n, const char **seq,
+		       unsigned int len)
+{
+	const char *at = ir.op[w[0]];
+	unsigned int atlen = ir.oplen[w[0]];
+
+	ir_begin();
+	swap_run(w, n, seq, len);
+	if (ir_cost_delta() >= 0) {
+		ir_rollback();
+		return 0;
+	}
+	ir_commit();
+	trace("Using %s at %.*s\n", seq[len - 1], atlen, at);
+	return 1;
+}
+
+static void use_8085(void)
+{
+	unsigned int i, n, len;
+	unsigned int w[6];
+	const char *seq[4];
+	char *t;
+
+	if (!(ctx->cpu->ops & OP_8085))
+		return;
+	for (i = ir.next[0]; i; i = ir.next[i]) {
+		uint32_t dead;
+
+		n = run_of(i, w, 6);
+		len = 0;
+		/* HL -= BC, or DE if we can copy it into BC */
+		if (n == 6 && op_is(w[0], "MOV", REG_A, REG_L)
+		    && (op_is(w[1], "SUB", REG_A, REG_C)
+			|| op_is(w[1], "SUB", REG_A, REG_E))
+		    && op_is(w[2], "MOV", REG_L, REG_A)
+		    && op_is(w[3], "MOV", REG_A, REG_H)
+		    && op_is(w[4], "SBB", REG_A, ir.sr[w[1]] - 1)
+		    && op_is(w[5], "MOV", REG_H, REG_A)) {
+			dead = ~ir.need[w[5]];
+			if (!(dead & REGM_A) || !(dead & REGM_PSW))
+				continue;
+			if (ir.sr[w[1]] == REG_E) {
+				if ((dead & (REGM_B | REGM_C))
+				    != (REGM_B | REGM_C))
+					continue;
+				seq[len++] = "MOV B,D";
+				seq[len++] = "MOV C,E";
+			}
+			seq[len++] = "DSUB";
+			replace_run(w, 6, seq, len);
+			continue;
+		}
+		/* Rotate DE left through the carry */
+		if (n == 6 && op_is(w[0], "MOV", REG_A, REG_E)
+		    && op_is(w[1], "RAL", 0, 0)
+		    && op_is(w[2], "MOV", REG_E, REG_A)
+		    && op_is(w[3], "MOV", REG_A, REG_D)
+		    && op_is(w[4], "RAL", 0, 0)
+		    && op_is(w[5], "MOV", REG_D, REG_A)
+		    && !(ir.need[w[5]] & REGM_A)) {
+			seq[len++] = "RDEL";
+			replace_run(w, 6, seq, len);
+			continue;
+		}
+		/* Or shift it when the carry going in is clear */
+		if (n >= 3 && op_is(w[0], "XCHG", 0, 0)
+		    && op_is(w[1], "DAD", REG_H, REG_H)
+		    && op_is(w[2], "XCHG", 0, 0)
+		    && (ir.fknown[ir.prev[i]] & FLAG_CY)
+		    && !(ir.fvalue[ir.prev[i]] & FLAG_CY)) {
+			seq[len++] = "RDEL";
+			replace_run(w, 3, seq, len);
+			continue;
+		}
+		/* Words in the frame. HL ends up one past the address */
+		if (n == 6 && op_is(w[0], "XCHG", 0, 0) && ldsi_offset(w[1])
+		    && op_is(w[3], "MOV", MEM_HL, REG_E)
+		    && op_is(w[4], "INX", REG_H, REG_H)
+		    && op_is(w[5], "MOV", MEM_HL, REG_D)) {
+			dead = ~ir.need[w[5]];
+			if ((dead & (REGM_D | REGM_E | REGM_H | REGM_L | REGM_PSW))
+			    != (REGM_D | REGM_E | REGM_H | REGM_L | REGM_PSW))
+				continue;
+			t = zalloc(16);
+			sprintf(t, "LDSI %u", ir.addrconst[w[1]]);
+			seq[len++] = t;
+			seq[len++] = "SHLX";
+			replace_run(w, 6, seq, len);
+			continue;
+		}
+		if (n < 5 || !ldsi_offset(w[0])
+		    || !op_is(w[3], "INX", REG_H, REG_H))
+			continue;
+		t = zalloc(16);
+		sprintf(t, "LDSI %u", ir.addrconst[w[0]]);
+		seq[len++] = t;
+		dead = ~ir.need[w[4]];
+		if (n == 6 && op_is(w[2], "MOV", REG_E, MEM_HL)
+		    && op_is(w[4], "MOV", REG_D, MEM_HL)
+		    && op_is(w[5], "XCHG", 0, 0)
+		    && !(ir.need[w[5]] & (REGM_D | REGM_E | REGM_PSW))) {
+			seq[len++] = "LHLX";
+			replace_run(w, 6, seq, len);
+		} else if (n == 6 && op_is(w[2], "MOV", REG_A, MEM_HL)
+		    && op_is(w[4], "MOV", REG_H, MEM_HL)
+		    && op_is(w[5], "MOV", REG_L, REG_A)
+		    && !(ir.need[w[5]] &
+			 (REGM_A | REGM_D | REGM_E | REGM_PSW))) {
+			seq[len++] = "LHLX";
+			replace_run(w, 6, seq, len);
+		} else if (op_is(w[2], "MOV", REG_E, MEM_HL)
+		    && op_is(w[4], "MOV", REG_D, MEM_HL)
+		    && (dead & (REGM_H | REGM_L | REGM_PSW))
+			== (REGM_H | REGM_L | REGM_PSW)) {
+			seq[len++] = "LHLX";
+			seq[len++] = "XCHG";
+			replace_run(w, 5, seq, len);
+		} else if (op_is(w[2], "MOV", MEM_HL, REG_E)
+		    && op_is(w[4], "MOV", MEM_HL, REG_D)
+		    && (dead & (REGM_D | REGM_E | REGM_H | REGM_L | REGM_PSW))
+			== (REGM_D | REGM_E | REGM_H | REGM_L | REGM_PSW)) {
+			seq[0] = "XCHG";
+			seq[1] = t;
+			seq[2] = "SHLX";
+			replace_run(w, 5, seq, 3);
+		}
+	}
+}
+
+/*
+ *	ack shifts by repeated DAD H. Eight or more of them in a row are
+ *	better done by moving bytes if nobody wants the carry.
+ */
+static void reduce_dad_chains(void)
+{
+	unsigned int i = ir.next[0];
+	while (i) {
+		unsigned int e = i;
+		unsigned int x;
+		unsigned int c = 0;
+
+		while (e && strcasecmp(OPINFO(e)->op, "DAD") == 0
+		       && ir.sr[e] == REG_H && (e == i || ir.label[e] == NULL)) {
+			c++;
+			e = ir.next[e];
+		}
+		if (c < 8 || (ir.need[ir.prev[e]] & REGM_PSW)
+		    || (c >= 16 && cost_text("LXI H,0") > c * cost(i))
+		    || (cost_text("MOV H,L") + cost_text("MVI L,0") >
+			8 * cost(i))) {
+			i = c ? e : ir.next[i];
+			continue;
+		}
+		trace("Shift by %u\n", c);
+		x = ir.next[i];
+		if (c >= 16) {
+			set_text(i, "LXI H,0");
+			c--;
+		} else {
+			set_text(i, "MOV H,L");
+			set_text(x, "MVI L,0");
+			x = ir.next[x];
+			c = 6;
+		}
+		while (c--) {
+			unsigned int nx = ir.next[x];
+			eliminate_instruction(x);
+			x = nx;
+		}
+		i = e;
+	}
+}
+
+/*
+ *	Remove moves whose destination already holds the value being copied,
+ *	whether a constant, a symbol or just the same value number. An XCHG
+ *	of two pairs holding the same values does nothing either.
+ */
+static void eliminate_copies(void)
+{
+	unsigned int i = ir.next[0];
+	while (i) {
+		unsigned int p = ir.prev[i];
+		unsigned int n = ir.next[i];
+		if ((OPINFO(i)->flags & OP_MOV) && same_value(p, ir.dr[i], ir.sr[i]))
+			eliminate_instruction(i);
+		else if (strcasecmp(OPINFO(i)->op, "XCHG") == 0
+			 && same_value(p, REG_D, REG_H)
+			 && same_value(p, REG_E, REG_L))
+			eliminate_instruction(i);
+		i = n;
+	}
+}
+
+/*
+ *	How far is the pair from the value an LXI wants, if it is near. This
+ *	works for numbers and for the same symbol at different offsets.
+ */
+#define NO_DELTA	0x7FFF
+
+static int lxi_delta(unsigned int i)
+{
+	unsigned int p = ir.prev[i];
+	int r = ir.dr[i];
+	uint16_t d;
+
+	if (ir.addrconst[i] != CONST_UNKNOWN && know_pair_value(p, r))
+		d = ir.addrconst[i] - pair_value(p, r);
+	else if (ir.sym[i] && know_pair_sym(p, r)
+		 && reg_sym(p, r)->sym == ir.sym[i])
+		d = ir.symoff[i] - reg_sym(p, r)->off;
+	else
+		return NO_DELTA;
+	if (d <= 2 || d >= 0xFFFE)
+		return (int16_t)d;
+	return NO_DELTA;
+}
+
+/* Labels are now interned so we can spot label relative inx/dex fixups
+   and 16bit duplicates as well as numeric ones */
+static void adjust_immed16(void)
+{
+	unsigned int i = ir.next[0];
+	while (i) {
+		/* Optimise LXI if we can */
+		if (strcasecmp(OPINFO(i)->op, "LXI") == 0 && ir.dr[i] != REG_SP) {
+			int d = lxi_delta(i);
+			int rl = 0, rh = 0;
+
+			/* One or two steps, if that is cheaper than the load */
+			if (d != NO_DELTA && d != 0
+			    && (d < 0 ? -d : d) * cost_op(find_operation("INX"), 0)
+			       > cost(i))
+				d = NO_DELTA;
+			if (d == 0)
+				eliminate_instruction(i);
+			else if (d == -1)
+				make_op1(i, "DEX");
+			else if (d == 1)
+				make_op1(i, "INX");
+			else if (d == -2) {
+				make_op1(i, "DEX");
+				add_op1(i, "DEX");
+			} else if (d == 2) {
+				make_op1(i, "INX");
+				add_op1(i, "INX");
+			} else if (ir.addrconst[i] != CONST_UNKNOWN) {
+				/* Look for our register values in a pair of others.
+				   It's only a win if they are both present and we are
+				   not exchanging halves with ourself */
+				rl = find_reg_value(ir.prev[i], ir.addrconst[i] & 0xFF);
+				rh = find_reg_value(ir.prev[i], ir.addrconst[i] >> 8);
+			} else if (ir.sym[i]) {
+				/* Same again for the halves of a symbol */
+				rl = find_reg_sym(ir.prev[i], ir.sym[i], ir.symoff[i], 0);
+				rh = find_reg_sym(ir.prev[i], ir.sym[i], ir.symoff[i], 1);
+			}
+			/* We get in a mess if we want to load de from ed */
+			if (rl && rh && !(rl == ir.dr[i] && rh == ir.dr[i] + 1)
+			    && 2 * cost_op(find_operation("MOV"), 0) <= cost(i)) {
+				int r = ir.dr[i];
+				/* One half may already be in place */
+				if (rh == r)
+					make_op2_r(i, "MOV", r + 1, rl);
+				else if (rl == r + 1)
+					make_op2_r(i, "MOV", r, rh);
+				/* If the low part is in the register
+				   we are setting up do it first */
+				else if (rl == r) {
+					make_op2_r(i, "MOV", r + 1, rl);
+					add_op2_r(i, "MOV", r, rh);
+				} else {
+					make_op2_r(i, "MOV", r, rh);
+					add_op2_r(i, "MOV", r + 1, rl);
+				}
+			}
+		}
+		else if (strcasecmp(OPINFO(i)->op, "DAD") == 0 && know_pair_value(ir.prev[i], ir.sr[i])) {
+			/* Not much to say here. At this level we don't
+			   eliminate constant maths but we can fix up
+			   DAD to INX and DEX */
+			uint16_t v = pair_value(ir.prev[i], ir.sr[i]);
+			unsigned int c = cost_op(find_operation("INX"), 0);
+			/* DAD sets carry, INX and DEX don't touch the flags */
+			if (!(ir.need[i] & REGM_PSW)) {
+				if (v == 0)
+					eliminate_instruction(i);
+				if (v == 1 && c <= cost(i))
+					make_op1(i, "INX");
+				if (v == 0xFFFF && c <= cost(i))
+					make_op1(i, "DEX");
+				if (v == 2 && 2 * c <= cost(i)) {
+					make_op1(i, "INX");
+					add_op1(i, "INX");
+				}
+				if (v == 0xFFFE && 2 * c <= cost(i)) {
+					make_op1(i, "DEX");
+					add_op1(i, "DEX");
+				}
+			}
+		}
+		i = ir.next[i];
+	}
+}
+
+
+/* We walk backwards to propagate need values. A need is copied back until
+   a set for it is found. We have some artificial needs on call/ret etc so
+   that we don't optimize out stuff like return values
+   
+   A value is needed if it was needed by the instruction after and not
+   set by this one. It may still be needed even if set because the set may be
+   an operation depending upon it (eg inr a) */
+
+static void propagate_need(void)
+{
+	unsigned int i = ir.prev[0];
+
+	while (i) {
+		/* Can we eliminate the instruction we are considering ? */
+		/* If it has no side effects and we don't need any of its outputs
+		   kill it off */
+		if (!(ir.need[i] & ir.set[i])
+		    && !(ir.set[i] & KEEPMASK))
+			eliminate_instruction(i);
+		else {
+			/* If not propagate the requirements it had */
+//			printf("%s: need was %x now ", ir.op[i],
+//			       ir.need[ir.prev[i]]);
+			ir.need[ir.prev[i]] |= need_past(i);
+//			printf("%x\n", ir.need[ir.prev[i]]);
+		}
+		i = ir.prev[i];
+	}
+}
+
+
+
+/*
+ *	Control flow. The code is split into blocks with one way in at the
+ *	top and the branches at the bottom. Block 0 is a dummy that leads to
+ *	the start of the code and to every label that might be reached from
+ *	code we can't see. Anything that leaves to somewhere unknown is an
+ *	exit and we assume needs everything.
+ */
+struct block {
+	unsigned int first, last;
+	unsigned int succ[2];	/* 0 for none */
+	unsigned int pred;	/* Index into cfg_pred */
+	unsigned int npred;
+	unsigned int idom;
+	unsigned int rpo;	/* Position in reverse post order */
+	uint32_t live_in, live_out;
+	uint8_t exit;
+	uint8_t entry;
+	uint8_t mark;
+};
+
+#define NO_RPO		0xFFFFFFFF
+
+static PERTHREAD struct block *blocks;
+static PERTHREAD unsigned int nblocks;
+static PERTHREAD unsigned int *blockof;	/* Block for each instruction */
+static PERTHREAD unsigned int *cfg_pred;
+static PERTHREAD unsigned int *rpo_order;
+static PERTHREAD unsigned int nrpo;
+
+/*
+ *	Point each branch at the label it goes to. A label used by anything
+ *	but a jump, such as a call, a jump table or an address load, is an
+ *	entry point. So are C names as the compiler exports them.
+ */
+static void link_labels(void)
+{
+	struct label **lab = zalloc((nsyms + 1) * sizeof(struct label *));
+	unsigned int i;
+
+	for (i = ir.next[0]; i; i = ir.next[i]) {
+		struct label *l = ir.label[i];
+		if (l) {
+			lab[l->sym] = l;
+			l->entry = (l->namelen && *l->name == '_')
+				|| lookup_symbol(l->name, l->namelen)->data;
+		}
+	}
+	for (i = ir.next[0]; i; i = ir.next[i]) {
+		struct label *l = lab[ir.sym[i]];
+		ir.target[i] = NULL;
+		if (ir.sym[i] == 0 || l == NULL)
+			continue;
+		if ((OPINFO(i)->flags & OP_BRA) && ir.symoff[i] == 0)
+			ir.target[i] = l;
+		else
+			l->entry = 1;
+	}
+}
+
+static int ends_block(unsigned int i)
+{
+	return OPINFO(i)->flags & (OP_BRA | OP_RET | OP_DATA);
+}
+
+static void cfg_dfs(unsigned int b)
+{
+	unsigned int n;
+	blocks[b].mark = 1;
+	if (b == 0) {
+		for (n = 1; n < nblocks; n++)
+			if (blocks[n].entry && !blocks[n].mark)
+				cfg_dfs(n);
+	}
+	for (n = 0; n < 2; n++)
+		if (blocks[b].succ[n] && !blocks[blocks[b].succ[n]].mark)
+			cfg_dfs(blocks[b].succ[n]);
+	/* Post order, reversed as we fill from the end */
+	rpo_order[--nrpo] = b;
+}
+
+static unsigned int dom_intersect(unsigned int a, unsigned int b)
+{
+	while (a != b) {
+		while (blocks[a].rpo > blocks[b].rpo)
+			a = blocks[a].idom;
+		while (blocks[b].rpo > blocks[a].rpo)
+			b = blocks[b].idom;
+	}
+	return a;
+}
+
+static int dominates(unsigned int a, unsigned int b)
+{
+	while (b != a) {
+		/* Blocks we can't reach have no dominator */
+		if (b == 0 || b == NO_RPO)
+			return 0;
+		b = blocks[b].idom;
+	}
+	return 1;
+}
+
+static void compute_dominators(void)
+{
+	unsigned int n, k;
+	int changed = 1;
+
+	for (n = 0; n < nblocks; n++)
+		blocks[n].idom = NO_RPO;
+	blocks[0].idom = 0;
+	while (changed) {
+		changed = 0;
+		for (n = 1; n < nrpo; n++) {
+			struct block *b = blocks + rpo_order[n];
+			unsigned int d = NO_RPO;
+			for (k = 0; k < b->npred; k++) {
+				unsigned int p = cfg_pred[b->pred + k];
+				if (blocks[p].idom == NO_RPO)
+					continue;
+				d = d == NO_RPO ? p : dom_intersect(p, d);
+			}
+			if (d != b->idom) {
+				b->idom = d;
+				changed = 1;
+			}
+		}
+	}
+}
+
+/* Registers live into and out of each block */
+static void compute_liveness(void)
+{
+	int changed = 1;
+	int n;
+
+	while (changed) {
+		changed = 0;
+		for (n = nrpo - 1; n > 0; n--) {
+			struct block *b = blocks + rpo_order[n];
+			uint32_t live = b->exit ? REGM_ALL : 0;
+			unsigned int i;
+			if (b->succ[0])
+				live |= blocks[b->succ[0]].live_in;
+			if (b->succ[1])
+				live |= blocks[b->succ[1]].live_in;
+			b->live_out = live;
+			for (i = b->last; ; i = ir.prev[i]) {
+				live = (live & ~kill_mask(i)) | ir.ineed[i];
+				if (i == b->first)
+					break;
+			}
+			if (live != b->live_in) {
+				b->live_in = live;
+				changed = 1;
+			}
+		}
+	}
+}
+
+static void build_cfg(void)
+{
+	unsigned int i, n, k;
+	unsigned int npred = 0;
+
+	link_labels();
+	blocks = zalloc((ir.count + 1) * sizeof(struct block));
+	blockof = zalloc(ir.count * sizeof(unsigned int));
+	nblocks = 1;
+
+	for (i = ir.next[0]; i; i = ir.next[i]) {
+		unsigned int p = ir.prev[i];
+		if (p == 0 || ir.label[i] || ends_block(p)) {
+			blocks[nblocks].first = i;
+			blocks[nblocks].entry = p == 0 ||
+				(ir.label[i] && ir.label[i]->entry) ||
+				(OPINFO(p)->flags & OP_DATA);
+			nblocks++;
+		}
+		blockof[i] = nblocks - 1;
+		blocks[nblocks - 1].last = i;
+	}
+	for (n = 1; n < nblocks; n++) {
+		struct block *b = blocks + n;
+		unsigned int l = b->last;
+		if (OPINFO(l)->flags & OP_BRA) {
+			if (ir.target[l])
+				b->succ[0] = blockof[ir.target[l]->instruction];
+			else
+				b->exit = 1;
+		}
+		if (falls_through(l)) {
+			if (ir.next[l])
+				b->succ[1] = blockof[ir.next[l]];
+			else
+				b->exit = 1;
+		}
+		if (OPINFO(l)->flags & OP_DATA)
+			b->exit = 1;
+		/* A conditional jump to the next instruction */
+		if (b->succ[0] == b->succ[1])
+			b->succ[1] = 0;
+	}
+	/* Predecessor lists */
+	for (n = 1; n < nblocks; n++) {
+		if (blocks[n].entry)
+			blocks[n].npred++;
+		for (k = 0; k < 2; k++)
+			if (blocks[n].succ[k])
+				blocks[blocks[n].succ[k]].npred++;
+	}
+	for (n = 1; n < nblocks; n++) {
+		blocks[n].pred = npred;
+		npred += blocks[n].npred;
+		blocks[n].npred = 0;
+	}
+	cfg_pred = zalloc((npred + 1) * sizeof(unsigned int));
+	for (n = 1; n < nblocks; n++) {
+		if (blocks[n].entry)
+			cfg_pred[blocks[n].pred + blocks[n].npred++] = 0;
+		for (k = 0; k < 2; k++) {
+			struct block *s = blocks + blocks[n].succ[k];
+			if (blocks[n].succ[k])
+				cfg_pred[s->pred + s->npred++] = n;
+		}
+	}
+	/* Order the blocks we can reach, the rest are dead code */
+	rpo_order = zalloc(nblocks * sizeof(unsigned int));
+	nrpo = nblocks;
+	cfg_dfs(0);
+	if (nrpo) {
+		/* Close up the gap left by unreachable blocks */
+		memmove(rpo_order, rpo_order + nrpo,
+			(nblocks - nrpo) * sizeof(unsigned int));
+		nrpo = nblocks - nrpo;
+	} else
+		nrpo = nblocks;
+	for (n = 0; n < nblocks; n++)
+		blocks[n].rpo = NO_RPO;
+	for (n = 0; n < nrpo; n++)
+		blocks[rpo_order[n]].rpo = n;
+	compute_dominators();
+	compute_liveness();
+}
+
+/* Mark the natural loop with header h */
+static void mark_loop(unsigned int h)
+{
+	unsigned int *stack = zalloc(nblocks * sizeof(unsigned int));
+	unsigned int sp = 0;
+	unsigned int n, k;
+
+	for (n = 0; n < nblocks; n++)
+		blocks[n].mark = 0;
+	blocks[h].mark = 1;
+	for (k = 0; k < blocks[h].npred; k++) {
+		unsigned int p = cfg_pred[blocks[h].pred + k];
+		if (p && dominates(h, p) && !blocks[p].mark) {
+			blocks[p].mark = 1;
+			stack[sp++] = p;
+		}
+	}
+	while (sp) {
+		struct block *b = blocks + stack[--sp];
+		for (k = 0; k < b->npred; k++) {
+			unsigned int p = cfg_pred[b->pred + k];
+			if (!blocks[p].mark && blocks[p].rpo != NO_RPO) {
+				blocks[p].mark = 1;
+				stack[sp++] = p;
+			}
+		}
+	}
+}
+
+/*
+ *	Find where to put code so it runs once on the way into the loop. We
+ *	need a single block outside the loop that goes only to the header,
+ *	either by falling into it or with a jump at the end. Returns the
+ *	instruction to put code after, or -1 if there is nowhere.
+ */
+static int preheader_point(unsigned int h)
+{
+	unsigned int q = 0;
+	unsigned int k;
+	struct block *b;
+
+	if (blocks[h].entry)
+		return -1;
+	for (k = 0; k < blocks[h].npred; k++) {
+		unsigned int p = cfg_pred[blocks[h].pred + k];
+		if (blocks[p].mark)
+			continue;
+		if (q || p == 0)
+			return -1;
+		q = p;
+	}
+	b = blocks + q;
+	if (q == 0 || b->exit || (b->succ[0] && b->succ[0] != h)
+	    || (b->succ[1] && b->succ[1] != h))
+		return -1;
+	if (!falls_through(b->last)) {
+		if (ir.label[b->last])
+			return -1;
+		return ir.prev[b->last];
+	}
+	return b->last;
+}
+
+/* Loads of values that can't change whilst we go round the loop */
+static int invariant_load(unsigned int i, int memwrite)
+{
+	struct optab *o = OPINFO(i);
+
+	/* The header label can move down if there is room */
+	if (ir.label[i] && (ir.label[ir.next[i]]
+			    || blockof[i] != blockof[ir.next[i]]))
+		return 0;
+	if ((o->flags & OP_MVI) && ir.dr[i] <= REG_L)
+		return 1;
+	if (strcasecmp(o->op, "LXI") == 0 && ir.dr[i] != REG_SP)
+		return 1;
+	/* Something outside the file may change a global it can see, so
+	   only a word nobody else can name stays put */
+	if (strcasecmp(o->op, "LHLD") == 0 && !memwrite && ir.sym[i]
+	    && symlocal[ir.sym[i]])
+		return 1;
+	return 0;
+}
+
+/* Nothing else in the loop may change what i sets */
+static int sole_writer(unsigned int i)
+{
+	unsigned int b, j;
+
+	for (b = 1; b < nblocks; b++) {
+		if (!blocks[b].mark)
+			continue;
+		for (j = blocks[b].first; ; j = ir.next[j]) {
+			if (j != i && (kill_mask(j) & ir.iset[i]))
+				return 0;
+			if (j == blocks[b].last)
+				break;
+		}
+	}
+	return 1;
+}
+
+/*
+ *	Move a constant load out of the loop when nothing else in the loop
+ *	writes the register and the value it had coming in isn't used. We
+ *	move one at a time as it changes the blocks.
+ */
+static int hoist_loop(unsigned int h, unsigned int pre)
+{
+	unsigned int n, i;
+	int memwrite = 0;
+
+	for (n = 1; n < nblocks; n++) {
+		if (!blocks[n].mark)
+			continue;
+		for (i = blocks[n].first; ; i = ir.next[i]) {
+			if ((ir.iset[i] & (MEMORYM | MEMM_HL | MEMM_HL_W))
+			    || (OPINFO(i)->flags & (OP_CALL | OP_KEEP)))
+				memwrite = 1;
+			if (i == blocks[n].last)
+				break;
+		}
+	}
+	for (n = 1; n < nblocks; n++) {
+		if (!blocks[n].mark)
+			continue;
+		for (i = blocks[n].first; ; i = ir.next[i]) {
+			if (invariant_load(i, memwrite)
+			    && !(ir.iset[i] & blocks[h].live_in)
+			    && sole_writer(i)) {
+				trace("Hoisting %.*s\n", ir.oplen[i], ir.op[i]);
+				if (ir.label[i]) {
+					ir.label[ir.next[i]] = ir.label[i];
+					ir.label[i]->instruction = ir.next[i];
+					ir.label[i] = NULL;
+				}
+				ir_unlink(i);
+				ir_link(i, pre);
+				return 1;
+			}
+			if (i == blocks[n].last)
+				break;
+		}
+	}
+	return 0;
+}
+
+static void hoist_invariants(void)
+{
+	unsigned int n, k;
+	int moved = 1;
+	int pre;
+
+	find_local_symbols();
+	while (moved) {
+		moved = 0;
+		build_cfg();
+		for (n = 1; n < nblocks && !moved; n++) {
+			int header = 0;
+			if (blocks[n].rpo == NO_RPO)
+				continue;
+			for (k = 0; k < blocks[n].npred; k++) {
+				unsigned int p = cfg_pred[blocks[n].pred + k];
+				if (p && dominates(n, p))
+					header = 1;
+			}
+			if (!header)
+				continue;
+			mark_loop(n);
+			pre = preheader_point(n);
+			if (pre != -1)
+				moved = hoist_loop(n, pre);
+		}
+	}
+}
+
+/*
+ *	Block layout. Blocks that fall into the next stay together as chains.
+ *	A block that ends in a JMP has the chain it jumps to moved after it
+ *	if nothing falls into that chain, unless the jump is a loop back edge,
+ *	which we take to be the likely way. Blocks ending in data stay where
+ *	they are and we only reorder the runs of code between them. The jumps
+ *	this leaves pointing at the next instruction are removed afterwards.
+ */
+static PERTHREAD unsigned int *lnext, *lprev;
+
+/* Does the chain starting at h contain b */
+static int chain_has(unsigned int h, unsigned int b)
+{
+	for (; h; h = lnext[h])
+		if (h == b)
+			return 1;
+	return 0;
+}
+
+/* Move the instructions of block b to after instruction p */
+static unsigned int move_block(unsigned int b, unsigned int p)
+{
+	unsigned int i = blocks[b].first;
+	while (1) {
+		unsigned int n = ir.next[i];
+		int last = i == blocks[b].last;
+		if (ir.prev[i] != p) {
+			ir_unlink(i);
+			ir_link(i, p);
+		}
+		p = i;
+		if (last)
+			return p;
+		i = n;
+	}
+}
+
+static void layout_region(unsigned int rs, unsigned int re)
+{
+	unsigned int b, t, p;
+	unsigned int tail = 0;
+
+	for (b = rs; b <= re; b++) {
+		if (!falls_through(blocks[b].last))
+			continue;
+		if (b == re) {
+			tail = b;
+			break;
+		}
+		lnext[b] = b + 1;
+		lprev[b + 1] = b;
+	}
+	for (b = rs; b <= re; b++) {
+		unsigned int l = blocks[b].last;
+		if (strcmp(OPINFO(l)->op, "JMP") || ir.target[l] == NULL)
+			continue;
+		t = blockof[ir.target[l]->instruction];
+		if (t < rs || t > re || t == rs || lprev[t]
+		    || chain_has(t, b) || chain_has(t, tail)
+		    || dominates(t, b))
+			continue;
+		lnext[b] = t;
+		lprev[t] = b;
+	}
+	/* The chain we enter by first, the one we leave by last */
+	p = ir.prev[blocks[rs].first];
+	for (b = rs; b; b = lnext[b])
+		p = move_block(b, p);
+	for (t = rs + 1; t <= re; t++) {
+		if (lprev[t] || chain_has(t, tail) || chain_has(rs, t))
+			continue;
+		for (b = t; b; b = lnext[b])
+			p = move_block(b, p);
+	}
+	if (tail && !chain_has(rs, tail)) {
+		for (t = tail; lprev[t]; t = lprev[t]);
+		for (b = t; b; b = lnext[b])
+			p = move_block(b, p);
+	}
+}
+
+/* The next instruction that does something, and whether label l is on
+   the way there */
+static unsigned int next_real(unsigned int i, struct label *l, int *found)
+{
+	*found = 0;
+	for (i = ir.next[i]; i; i = ir.next[i]) {
+		if (ir.label[i] && ir.label[i] == l)
+			*found = 1;
+		if (ir.oplen[i])
+			return i;
+	}
+	return 0;
+}
+
+static void remove_jumps(void)
+{
+	unsigned int i, n, k;
+	int found;
+
+	for (i = ir.next[0]; i; i = n) {
+		const char *op = OPINFO(i)->op;
+		n = ir.next[i];
+		/* DJNZ does more than jump */
+		if (!(OPINFO(i)->flags & OP_BRA) || ir.target[i] == NULL
+		    || ir.iset[i])
+			continue;
+		next_real(i, ir.target[i], &found);
+		if (found) {
+			trace("Jump to next %.*s\n", ir.oplen[i], ir.op[i]);
+			eliminate_instruction(i);
+			continue;
+		}
+		/* Jcc L1; JMP L2; L1: becomes Jncc L2 */
+		if (strcmp(op, "JMP") == 0 || strcmp(op, "PCHL") == 0
+		    || ir.label[n] || strcmp(OPINFO(n)->op, "JMP"))
+			continue;
+		next_real(n, ir.target[i], &found);
+		if (!found)
+			continue;
+		for (k = 0; conds[k].cc; k++) {
+			const char *p = ir.op[n];
+			const char *e = p + ir.oplen[n];
+			char *t;
+			if (strcmp(op + 1, conds[k].cc))
+				continue;
+			while (p < e && !isspace(*p))
+				p++;
+			t = zalloc(4 + (e - p));
+			sprintf(t, "J%s%.*s", conds[k ^ 1].cc, (int)(e - p), p);
+			trace("Invert %.*s\n", ir.oplen[i], ir.op[i]);
+			set_text(i, t);
+			ir.target[i] = ir.target[n];
+			n = ir.next[n];
+			eliminate_instruction(ir.prev[n]);
+			break;
+		}
+	}
+}
+
+static void layout_blocks(void)
+{
+	unsigned int b, rs;
+
+	/* Moving blocks changes what falls into what */
+	analysed = 0;
+	build_cfg();
+	lnext = zalloc((nblocks + 1) * sizeof(unsigned int));
+	lprev = zalloc((nblocks + 1) * sizeof(unsigned int));
+	/* Runs of blocks between data */
+	for (rs = 1; rs < nblocks; rs = b + 1) {
+		for (b = rs; b < nblocks - 1; b++)
+			if (OPINFO(blocks[b].last)->flags & OP_DATA)
+				break;
+		if (OPINFO(blocks[b].last)->flags & OP_DATA) {
+			if (b > rs)
+				layout_region(rs, b - 1);
+		} else
+			layout_region(rs, b);
+	}
+	remove_jumps();
+}
+
+/*
+ *	Switches. ACK hands a switch to .csa2 with a table of labels for a
+ *	range of values or to .csb2, which searches a table of value and
+ *	label pairs. The case value is in DE and the table in HL. Hand
+ *	written code may use a chain of CPI and JZ on A instead. A dense
+ *	search table can become a range one, and either can be replaced by
+ *	a bounds check and a PCHL through the table when the cost model
+ *	says so. We cost the worst case, which is the default, as that is
+ *	what matters in an interrupt handler.
+ */
+#define MAX_CASES	256
+#define MAX_WORDS	(2 * MAX_CASES + 3)
+
+static const struct casehelper {
+	const char *name;
+	unsigned int cycles;	/* Rough time in the helper */
+	unsigned int per;	/* and per entry searched */
+} casehelpers[] = {
+	{ ".csa2", 140, 0 },
+	{ ".csb2", 70, 60 },
+	{ NULL, }
+};
+
+struct caseword {
+	const char *name;	/* NULL for a number */
+	unsigned int len;
+	uint16_t val;
+	unsigned int i;		/* The line it is on */
+};
+
+/* Labels we make are named after the function so they stay unique in
+   the file, and in the output of a function we reuse from the cache */
+static PERTHREAD unsigned int nextlabel;
+
+static struct label *add_label(unsigned int i)
+{
+	struct label *f = NULL;
+	struct label *l;
+	unsigned int n;
+	char *t;
+
+	if (ir.label[i])
+		return ir.label[i];
+	for (n = ir.next[0]; n && f == NULL; n = ir.next[n])
+		if (ir.label[n] && *ir.label[n]->name == '_')
+			f = ir.label[n];
+	t = zalloc((f ? f->namelen : 0) + 16);
+	do
+		sprintf(t, "O85%.*s_%u", f ? f->namelen : 0, f ? f->name : "",
+			++nextlabel);
+	while (find_file_name(t, strlen(t)));
+	l = new_label();
+	l->name = t;
+	l->namelen = strlen(t);
+	l->sym = find_symbol(t, l->namelen);
+	l->instruction = i;
+	ir.label[i] = l;
+	return l;
+}
+
+/* Could anything from block b on read one of the registers in mask
+   before it is set. seen holds those already followed from each block */
+static int regs_read(unsigned int b, uint32_t *seen, uint32_t mask)
+{
+	unsigned int i, k;
+
+	mask &= ~seen[b];
+	if (mask == 0)
+		return 0;
+	if (blocks[b].rpo == NO_RPO)
+		return 1;
+	seen[b] |= mask;
+	for (i = blocks[b].first; ; i = ir.next[i]) {
+		struct optab *o = OPINFO(i);
+		if (o->flags & (OP_CALL | OP_DATA))
+			return 1;
+		if (o->flags & OP_BRA) {
+			/* Jumps only look at the flags, DJNZ at B too */
+			if (strcmp(o->op, "PCHL") == 0 || (ir.iset[i] & mask)
+			    || (falls_through(i) && (mask & REGM_PSW)))
+				return 1;
+		} else if (ir.ineed[i] & mask)
+			return 1;
+		else
+			mask &= ~ir.iset[i];
+		if (mask == 0)
+			return 0;
+		if (i == blocks[b].last)
+			break;
+	}
+	if (blocks[b].exit)
+		return 1;
+	for (k = 0; k < 2; k++)
+		if (blocks[b].succ[k] && regs_read(blocks[b].succ[k], seen, mask))
+			return 1;
+	return 0;
+}
+
+/* The words of the .data2 lines from i on, until a label or anything
+   else. Only plain numbers and names are understood */
+static unsigned int read_words(unsigned int i, struct caseword *w)
+{
+	unsigned int n = 0;
+
+	for (; i && (n == 0 || !ir.label[i]); i = ir.next[i]) {
+		const char *p = ir.op[i];
+		const char *e = p + ir.oplen[i];
+		if (strcmp(OPINFO(i)->op, ".data2"))
+			break;
+		while (p < e && !isspace(*p))
+			p++;
+		while (p < e) {
+			struct slice s;
+			uint16_t off;
+			int v;
+
+			while (p < e && isspace(*p))
+				p++;
+			s.p = p;
+			while (p < e && *p != ',')
+				p++;
+			s.len = p - s.p;
+			while (s.len && isspace(s.p[s.len - 1]))
+				s.len--;
+			if (p < e)
+				p++;
+			if (n == MAX_WORDS)
+				return 0;
+			w[n].i = i;
+			w[n].name = NULL;
+			if (s.len && (isdigit(*s.p) || *s.p == '-')) {
+				v = DecodeConst(&s);
+				if (v == CONST_UNKNOWN)
+					return 0;
+				w[n].val = v;
+			} else if (DecodeSym(&s, &off) && off == 0) {
+				w[n].name = s.p;
+				w[n].len = s.len;
+			} else
+				return 0;
+			n++;
+		}
+	}
+	return n;
+}
+
+/* Put a .data2 of the words at i, and more lines after it as needed.
+   Returns the last */
+static unsigned int put_words(unsigned int i, struct caseword **w,
+			      unsigned int n)
+{
+	unsigned int k, l;
+	char *t;
+
+	for (k = 0; k < n; k += 8) {
+		t = zalloc(8 * 40);
+		strcpy(t, ".data2 ");
+		for (l = k; l < n && l < k + 8; l++)
+			sprintf(t + strlen(t), "%s%.*s", l > k ? ", " : "",
+				w[l]->len, w[l]->name);
+		if (k)
+			i = append_instruction(i);
+		set_text(i, t);
+	}
+	return i;
+}
+
+/* Jump through tab with the index in HL. Uses A and the pair given */
+static unsigned int seq_dispatch(const char **seq, unsigned int len,
+				 struct label *tab, int pair)
+{
+	char *t = zalloc(tab->namelen + 8);
+
+	sprintf(t, "LXI %c,%.*s", regname(pair), tab->namelen, tab->name);
+	seq[len++] = "DAD H";
+	seq[len++] = t;
+	seq[len++] = pair == REG_D ? "DAD D" : "DAD B";
+	if (pair == REG_D && (ctx->cpu->ops & OP_8085)) {
+		seq[len++] = "XCHG";
+		seq[len++] = "LHLX";
+	} else {
+		seq[len++] = "MOV A,M";
+		seq[len++] = "INX H";
+		seq[len++] = "MOV H,M";
+		seq[len++] = "MOV L,A";
+	}
+	seq[len++] = "PCHL";
+	return len;
+}
+
+static char *jump_text(const char *op, const char *name, unsigned int len)
+{
+	char *t = zalloc(len + 8);
+	sprintf(t, "%s %.*s", op, len, name);
+	return t;
+}
+
+/* LXI H,table; JMP .csa2 or .csb2 */
+static int case_helper(unsigned int i)
+{
+	const struct casehelper *h;
+	struct caseword *w = zalloc(MAX_WORDS * sizeof(struct caseword));
+	struct caseword **ent = zalloc((MAX_CASES + 3) * sizeof(void *));
+	struct caseword *lo = w + 1;
+	struct caseword span;
+	struct label *tab = NULL;
+	unsigned int j = ir.next[i];
+	unsigned int n, k, r, cnt, d, x, len = 0, refs = 0;
+	unsigned int keep, range, flat;
+	const char *seq[MAX_SEQ];
+	int16_t min = 0x7FFF, max = -0x8000;
+	char *t;
+
+	if (!op_is(i, "LXI", REG_H, 0) || ir.sym[i] == 0 || ir.symoff[i]
+	    || j == 0 || ir.label[j] || strcmp(OPINFO(j)->op, "JMP"))
+		return 0;
+	for (h = casehelpers; h->name; h++)
+		if (is_symbol(ir.sym[j], h->name))
+			break;
+	if (h->name == NULL)
+		return 0;
+	for (x = ir.next[0]; x; x = ir.next[x]) {
+		if (ir.sym[x] == ir.sym[i])
+			refs++;
+		if (ir.label[x] && ir.label[x]->sym == ir.sym[i])
+			tab = ir.label[x];
+	}
+	/* We rewrite the table so it must be ours alone */
+	if (tab == NULL || refs != 1
+	    || lookup_symbol(tab->name, tab->namelen)->data
+	    || !file_local(tab->name, tab->namelen))
+		return 0;
+	d = tab->instruction;
+	if (ir.oplen[d] == 0)
+		d = ir.next[d];
+	n = read_words(d, w);
+	if (n < 3 || w[0].name == NULL || w[1].name)
+		return 0;
+	if (h == casehelpers) {
+		/* Default, low bound, entries - 1, labels */
+		cnt = r = w[2].val + 1;
+		if (w[2].name || r > MAX_CASES || n < 3 + r)
+			return 0;
+		for (k = 0; k < r; k++) {
+			if (w[3 + k].name == NULL)
+				return 0;
+			ent[k] = w + 3 + k;
+		}
+		k = 3 + r;
+	} else {
+		/* Default, count, then value and label pairs */
+		cnt = w[1].val;
+		if (cnt == 0 || cnt > MAX_CASES || n < 2 + 2 * cnt)
+			return 0;
+		for (k = 0; k < cnt; k++) {
+			int16_t v = w[2 + 2 * k].val;
+			if (w[2 + 2 * k].name || w[3 + 2 * k].name == NULL)
+				return 0;
+			if (v < min) {
+				min = v;
+				lo = w + 2 + 2 * k;
+			}
+			if (v > max)
+				max = v;
+		}
+		if (max - min >= MAX_CASES)
+			return 0;
+		r = max - min + 1;
+		for (k = 0; k < r; k++)
+			ent[k] = w;
+		/* The first of a repeated value is the one found */
+		for (k = cnt; k-- > 0; )
+			ent[(uint16_t)(w[2 + 2 * k].val - min)] = w + 3 + 2 * k;
+		k = 2 + 2 * cnt;
+	}
+	/* The table has to end with a line */
+	if (k < n && w[k].i == w[k - 1].i)
+		return 0;
+
+	/* What it costs now, with the range helper and inline */
+	keep = cost(i) + cost(j) + 2 * k * ctx->cost_bytes +
+		(h->cycles + h->per * cnt) * ctx->cost_cycles;
+	range = cost(i) + cost(j) + (6 + 2 * r) * ctx->cost_bytes +
+		casehelpers[0].cycles * ctx->cost_cycles;
+	if (lo->val) {
+		t = zalloc(16);
+		sprintf(t, "LXI H,%u", (uint16_t)-lo->val);
+		seq[len++] = t;
+		seq[len++] = "DAD D";
+	} else
+		seq[len++] = "XCHG";
+	seq[len++] = "MOV A,L";
+	t = zalloc(16);
+	sprintf(t, "SUI %u", r & 0xFF);
+	seq[len++] = t;
+	seq[len++] = "MOV A,H";
+	t = zalloc(16);
+	sprintf(t, "SBI %u", r >> 8);
+	seq[len++] = t;
+	seq[len++] = jump_text("JNC", w[0].name, w[0].len);
+	len = seq_dispatch(seq, len, tab, REG_D);
+	flat = seq_cost(seq, len) + 2 * r * ctx->cost_bytes;
+
+	if (flat < keep && flat < range) {
+		trace("Switch inline %.*s\n", ir.oplen[j], ir.op[j]);
+		swap_run(&i, 1, seq, len);
+		eliminate_instruction(j);
+	} else if (h != casehelpers && range < keep) {
+		trace("Switch by range %.*s\n", ir.oplen[j], ir.op[j]);
+		memmove(ent + 3, ent, r * sizeof(void *));
+		t = zalloc(8);
+		sprintf(t, "%d", min);
+		lo->name = t;
+		lo->len = strlen(t);
+		t = zalloc(8);
+		sprintf(t, "%u", r - 1);
+		span.name = t;
+		span.len = strlen(t);
+		ent[0] = w;
+		ent[1] = lo;
+		ent[2] = &span;
+		r += 3;
+		set_text(j, "JMP .csa2");
+	} else
+		return 0;
+	/* The new table goes where the old one started */
+	for (x = 1; x < k; x++)
+		if (w[x].i != w[x - 1].i)
+			eliminate_instruction(w[x].i);
+	put_words(d, ent, r);
+	return 1;
+}
+
+/* Take off the bottom value, bounds check and jump through the table */
+static unsigned int seq_chain(const char **seq, uint8_t min, unsigned int r,
+			      struct label *def, struct label *tab, int pair)
+{
+	unsigned int len = 0;
+	char *t;
+
+	if (min) {
+		t = zalloc(16);
+		sprintf(t, "SUI %u", min);
+		seq[len++] = t;
+	}
+	if (r < 256) {
+		t = zalloc(16);
+		sprintf(t, "CPI %u", r);
+		seq[len++] = t;
+		seq[len++] = jump_text("JNC", def->name, def->namelen);
+	}
+	seq[len++] = "MOV L,A";
+	seq[len++] = "MVI H,0";
+	return seq_dispatch(seq, len, tab, pair);
+}
+
+/* Can the cases do without the registers in mask */
+static int cases_free(struct label **to, unsigned int n, uint32_t mask)
+{
+	uint32_t *seen = zalloc(nblocks * sizeof(uint32_t));
+	unsigned int k;
+
+	for (k = 0; k < n; k++)
+		if (to[k] && regs_read(blockof[to[k]->instruction], seen, mask))
+			return 0;
+	return 1;
+}
+
+/* A chain of CPI and JZ on A from i. It ends by going on to the default
+   or with a JMP to it */
+static int case_chain(unsigned int i)
+{
+	struct label *to[256];
+	struct label none = { NULL, 0, "", 0, 0, 0, 0 };
+	struct label *def, *tab;
+	struct caseword *ent = zalloc(256 * sizeof(struct caseword));
+	struct caseword **ep = zalloc(256 * sizeof(void *));
+	unsigned int w[2 * MAX_CASES + 1];
+	unsigned int j, k, x, r, m, len, n = 0, old = 0;
+	uint32_t used = REGM_A | REGM_PSW | REGM_H | REGM_L;
+	int pair;
+	uint8_t min = 0xFF, max = 0;
+	const char *seq[MAX_SEQ];
+	int sect = datasect;
+
+	memset(to, 0, sizeof(to));
+	for (j = i; j && n < MAX_CASES; j = ir.next[ir.next[j]]) {
+		unsigned int b = ir.next[j];
+		uint8_t v = ir.addrconst[j];
+		if (strcmp(OPINFO(j)->op, "CPI") || ir.sym[j]
+		    || ir.addrconst[j] == CONST_UNKNOWN
+		    || (j != i && ir.label[j]) || b == 0 || ir.label[b]
+		    || strcmp(OPINFO(b)->op, "JZ") || ir.target[b] == NULL)
+			break;
+		/* The first of a repeated value is the one taken */
+		if (to[v] == NULL)
+			to[v] = ir.target[b];
+		if (v < min)
+			min = v;
+		if (v > max)
+			max = v;
+		w[2 * n] = j;
+		w[2 * n + 1] = b;
+		old += cost(j) + cost(b);
+		n++;
+	}
+	if (n < 3 || j == 0)
+		return 0;
+	m = 2 * n;
+	def = NULL;
+	if (ir.label[j] == NULL && strcmp(OPINFO(j)->op, "JMP") == 0
+	    && ir.target[j]) {
+		def = ir.target[j];
+		w[m++] = j;
+		old += cost(j);
+	}
+	/* The cases get the value less the bottom one and the default the
+	   flags of the bounds check. HL and a pair go on the jump */
+	if (cases_free(to, 256, used | REGM_D | REGM_E))
+		pair = REG_D;
+	else if (cases_free(to, 256, used | REGM_B | REGM_C))
+		pair = REG_B;
+	else
+		return 0;
+	if (regs_read(blockof[def ? def->instruction : j],
+		      zalloc(nblocks * sizeof(uint32_t)),
+		      REGM_PSW | (min ? REGM_A : 0)))
+		return 0;
+	r = max - min + 1;
+	len = seq_chain(seq, min, r, &none, &none, pair);
+	if (seq_cost(seq, len) + 2 * r * ctx->cost_bytes >= old)
+		return 0;
+
+	trace("Switch table %.*s\n", ir.oplen[i], ir.op[i]);
+	if (def == NULL)
+		def = add_label(j);
+	for (k = 0; k < r; k++) {
+		struct label *l = to[min + k] ? to[min + k] : def;
+		ent[k].name = l->name;
+		ent[k].len = l->namelen;
+		ep[k] = ent + k;
+	}
+	/* The table follows the code in a data section */
+	x = append_instruction(w[m - 1]);
+	set_text(x, ".sect .rom");
+	x = append_instruction(x);
+	tab = add_label(x);
+	x = put_words(x, ep, r);
+	x = append_instruction(x);
+	set_text(x, ".sect .text");
+	datasect = sect;
+	len = seq_chain(seq, min, r, def, tab, pair);
+	swap_run(w, m, seq, len);
+	return 1;
+}
+
+static int switch_tables(void)
+{
+	unsigned int i;
+	int changed = 1;
+	int any = 0;
+
+	while (changed) {
+		changed = 0;
+		build_cfg();
+		for (i = ir.next[0]; i && !changed; i = ir.next[i])
+			changed = case_helper(i) || case_chain(i);
+		any |= changed;
+	}
+	return any;
+}
+
+/* FNV-1a, used for the superoptimizer fingerprints, the cache keys and
+   the shared tails */
+static uint64_t hash_bytes(uint64_t h, const void *p, size_t len)
+{
+	const uint8_t *b = p;
+	while (len--) {
+		h ^= *b++;
+		h *= 0x100000001B3ULL;
+	}
+	return h;
+}
+
+/*
+ *	Cross jumping. Code that ends in a RET or JMP is hashed on its text
+ *	from each instruction on to the end. Where the tail of a run is the
+ *	same as one we have already seen, in this function or one written
+ *	earlier in the file, the run jumps to that copy instead. The same
+ *	instructions do the same thing whatever the state they start from so
+ *	the text is all we need to compare. It saves space and costs a jump.
+ *
+ *	To reach back into functions already done the output is held until
+ *	the end of the file. We can't do that for the cache as the entries
+ *	must stand alone, or when debugging.
+ */
+#define MAX_TAIL	16
+#define TAILHASH_SIZE	1024
+
+struct tail {
+	struct tail *next;
+	uint64_t hash;
+	const char *text;	/* From here to the end of the run */
+	char *own;		/* The text we allocated, for the first */
+	unsigned int at;	/* Instruction, or output line */
+};
+
+struct outline {
+	size_t off;		/* Start of the line in outbuf */
+	unsigned int namelen;	/* Label on the line in the text */
+	char *label;		/* or one we added for a tail */
+};
+
+static PERTHREAD int holding;
+static PERTHREAD char *outbuf;
+static PERTHREAD size_t outlen, outsize;
+static PERTHREAD struct outline *outlines;
+static PERTHREAD unsigned int noutlines, outlinesize;
+static PERTHREAD unsigned int nexttail;
+static PERTHREAD struct tail *filetails[TAILHASH_SIZE];
+
+/* Lower case and single spaces as for the cache keys */
+static char *tail_op(char *d, const char *p, unsigned int len)
+{
+	int space = 0;
+	while (len--) {
+		char c = tolower(*p++);
+		if (isspace(c)) {
+			space = 1;
+			continue;
+		}
+		if (space)
+			*d++ = ' ';
+		space = 0;
+		*d++ = c;
+	}
+	*d++ = '\n';
+	return d;
+}
+
+/* The text of the run w[0..n-1]. at[k] is where w[k] starts in it */
+static char *tail_text(unsigned int *w, unsigned int n, unsigned int *at,
+		       int file)
+{
+	unsigned int k;
+	size_t len = 1;
+	char *t, *p;
+
+	for (k = 0; k < n; k++)
+		len += ir.oplen[w[k]] + 1;
+	t = file ? malloc(len) : zalloc(len);
+	if (t == NULL)
+		fail("Out of memory.");
+	for (p = t, k = 0; k < n; k++) {
+		at[k] = p - t;
+		p = tail_op(p, ir.op[w[k]], ir.oplen[w[k]]);
+	}
+	*p = 0;
+	return t;
+}
+
+static uint64_t tail_hash(const char *t)
+{
+	return hash_bytes(0xCBF29CE484222325ULL, t, strlen(t));
+}
+
+/* Space each tail of the run takes. Only those that are bigger than a
+   jump by more than it costs are worth sharing */
+static void tail_bytes(unsigned int *w, unsigned int n, unsigned int *bytes)
+{
+	bytes[n] = 0;
+	while (n--)
+		bytes[n] = bytes[n + 1] + OPINFO(w[n])->bytes;
+}
+
+static int tail_pays(unsigned int bytes)
+{
+	return bytes * ctx->cost_bytes > cost_text("JMP");
+}
+
+static struct tail *find_tail(struct tail **tab, uint64_t h, const char *t)
+{
+	struct tail *p;
+	for (p = tab[h % TAILHASH_SIZE]; p; p = p->next)
+		if (p->hash == h && strcmp(p->text, t) == 0)
+			return p;
+	return NULL;
+}
+
+/* Remember the tails of a run. where[k] is what a jump to w[k] wants */
+static void note_tails(struct tail **tab, unsigned int *w, unsigned int n,
+		       const unsigned int *where, int file)
+{
+	unsigned int at[MAX_TAIL], bytes[MAX_TAIL + 1];
+	char *t = tail_text(w, n, at, file);
+	struct tail *p;
+	unsigned int k;
+
+	tail_bytes(w, n, bytes);
+	for (k = 0; k < n && tail_pays(bytes[k]); k++) {
+		p = file ? malloc(sizeof(struct tail)) : zalloc(sizeof(struct tail));
+		if (p == NULL)
+			fail("Out of memory.");
+		p->text = t + at[k];
+		p->hash = tail_hash(p->text);
+		p->own = (file && k == 0) ? t : NULL;
+		p->at = where[k];
+		p->next = tab[p->hash % TAILHASH_SIZE];
+		tab[p->hash % TAILHASH_SIZE] = p;
+	}
+	if (file && k == 0)
+		free(t);
+}
+
+/* A label for a line already written out */
+static const char *line_label(unsigned int n, unsigned int *len)
+{
+	struct outline *l = outlines + n;
+	char t[32];
+
+	if (l->namelen) {
+		*len = l->namelen;
+		return outbuf + l->off;
+	}
+	if (l->label == NULL) {
+		do
+			sprintf(t, "O85T%u", ++nexttail);
+		while (find_file_name(t, strlen(t)));
+		l->label = strdup(t);
+		if (l->label == NULL)
+			fail("Out of memory.");
+	}
+	*len = strlen(l->label);
+	return l->label;
+}
+
+/* Jump to an earlier copy of the longest tail of the run we can */
+static int share_tail(struct tail **tab, unsigned int *w, unsigned int n)
+{
+	unsigned int at[MAX_TAIL], bytes[MAX_TAIL + 1];
+	char *t = tail_text(w, n, at, 0);
+	struct tail *p;
+	const char *name;
+	unsigned int k, j, len;
+	uint64_t h;
+
+	tail_bytes(w, n, bytes);
+	/* Labels inside the tail are other ways into it */
+	for (k = n - 1; k > 0 && ir.label[w[k]] == NULL; k--);
+	for (; k < n && tail_pays(bytes[k]); k++) {
+		h = tail_hash(t + at[k]);
+		if ((p = find_tail(tab, h, t + at[k])) != NULL) {
+			struct label *l = add_label(p->at);
+			name = l->name;
+			len = l->namelen;
+		} else if (holding
+			   && (p = find_tail(filetails, h, t + at[k])) != NULL)
+			name = line_label(p->at, &len);
+		else
+			continue;
+		trace("Cross %.*s\n", len, name);
+		set_text(w[k], jump_text("JMP", name, len));
+		for (j = k + 1; j < n; j++)
+			eliminate_instruction(w[j]);
+		return 1;
+	}
+	return 0;
+}
+
+/* Add the instruction to the run being gathered. Returns how many are in
+   it when this ends one, or zero */
+static unsigned int tail_run(unsigned int *w, unsigned int *n, unsigned int i)
+{
+	unsigned int r;
+
+	if (OPINFO(i)->flags & (OP_PSEUDO | OP_DATA)) {
+		*n = 0;
+		return 0;
+	}
+	if (*n == MAX_TAIL)
+		memmove(w, w + 1, --*n * sizeof(*w));
+	w[(*n)++] = i;
+	if (falls_through(i))
+		return 0;
+	r = *n;
+	*n = 0;
+	return r;
+}
+
+static void cross_jump(void)
+{
+	struct tail **tab = zalloc(TAILHASH_SIZE * sizeof(struct tail *));
+	unsigned int w[MAX_TAIL];
+	unsigned int i, n = 0, r;
+
+	for (i = ir.next[0]; i; i = ir.next[i])
+		if ((r = tail_run(w, &n, i)) && !share_tail(tab, w, r))
+			note_tails(tab, w, r, w, 0);
+}
+
+/* Hold a line of output */
+static void hold_line(unsigned int i)
+{
+	struct outline *l;
+	size_t len = ir.oplen[i] + 4;
+
+	if (ir.label[i])
+		len += ir.label[i]->namelen;
+	if (noutlines == outlinesize) {
+		outlinesize = outlinesize ? outlinesize * 2 : 1024;
+		outlines = realloc(outlines,
+				   outlinesize * sizeof(struct outline));
+	}
+	while (outsize - outlen < len) {
+		outsize = outsize ? outsize * 2 : 65536;
+		outbuf = realloc(outbuf, outsize);
+	}
+	if (outlines == NULL || outbuf == NULL)
+		fail("Out of memory.");
+	l = outlines + noutlines++;
+	l->off = outlen;
+	l->namelen = 0;
+	l->label = NULL;
+	if (ir.label[i]) {
+		l->namelen = ir.label[i]->namelen;
+		memcpy(outbuf + outlen, ir.label[i]->name, l->namelen);
+		outlen += l->namelen;
+		outbuf[outlen++] = ':';
+	}
+	if (ir.oplen[i]) {
+		outbuf[outlen++] = '\t';
+		memcpy(outbuf + outlen, ir.op[i], ir.oplen[i]);
+		outlen += ir.oplen[i];
+	}
+	outbuf[outlen++] = '\n';
+}
+
+/* Remember the tails of the function just held, from line base on */
+static void keep_tails(unsigned int base)
+{
+	unsigned int w[MAX_TAIL], where[MAX_TAIL];
+	unsigned int i, n = 0, r, k;
+
+	for (i = ir.next[0]; i; i = ir.next[i], base++) {
+		if ((r = tail_run(w, &n, i)) == 0)
+			continue;
+		for (k = 0; k < r; k++)
+			where[k] = base - (r - 1) + k;
+		note_tails(filetails, w, r, where, 1);
+	}
+}
+
+static void release_output(void)
+{
+	struct tail *p;
+	unsigned int n;
+
+	for (n = 0; n < noutlines; n++)
+		free(outlines[n].label);
+	for (n = 0; n < TAILHASH_SIZE; n++) {
+		while ((p = filetails[n]) != NULL) {
+			filetails[n] = p->next;
+			free(p->own);
+			free(p);
+		}
+	}
+	free(outbuf);
+	free(outlines);
+	outbuf = NULL;
+	outlines = NULL;
+	outlen = outsize = 0;
+	noutlines = outlinesize = 0;
+	nexttail = 0;
+	holding = 0;
+}
+
+/* Write out what we held with the labels we added */
+static void write_output(void)
+{
+	unsigned int n;
+	size_t e;
+
+	for (n = 0; n < noutlines; n++) {
+		e = n + 1 < noutlines ? outlines[n + 1].off : outlen;
+		if (outlines[n].label)
+			fprintf(ctx->out, "%s:", outlines[n].label);
+		fwrite(outbuf + outlines[n].off, 1, e - outlines[n].off,
+		       ctx->out);
+	}
+	release_output();
+}
+
+/*
+ *	Z80 relative branches. They only ever make the code smaller so a
+ *	branch in range with the addresses as they are stays in range.
+ *	Nothing is in range across data as we don't know its size.
+ */
+static const char *relops[][2] = {
+	{ "JMP", "JR" }, { "JZ", "JRZ" }, { "JNZ", "JRNZ" },
+	{ "JC", "JRC" }, { "JNC", "JRNC" }, { NULL, }
+};
+
+/* DJNZ leaves the flags alone where DCR sets all but the carry. See if
+   anything from block b on could look at those before they are set,
+   taking DCR B at d and its JNZ as the DJNZ they would become */
+#define FLAG_NOTCY	(FLAG_ALL & ~FLAG_CY)
+
+static int notcy_read(unsigned int b, uint8_t *seen, unsigned int d)
+{
+	unsigned int i, k;
+
+	if (seen[b] || blocks[b].rpo == NO_RPO)
+		return seen[b] ? 0 : 1;
+	seen[b] = 1;
+	for (i = blocks[b].first; ; i = ir.next[i]) {
+		struct optab *o = OPINFO(i);
+		const char *op = o->op;
+		if (i == d || i == ir.next[d]) {
+			/* The DJNZ to be */
+		} else if (o->flags & (OP_BRA | OP_CALL | OP_RET)) {
+			if (strcmp(op, "RET") == 0)
+				return 0;
+			if (strcmp(op, "JMP") && strcmp(op, "JR")) {
+				for (k = 0; conds[k].cc; k++)
+					if (strcmp(op + 1, conds[k].cc) == 0)
+						break;
+				if (conds[k].cc == NULL
+				    || conds[k].flag != FLAG_CY)
+					return 1;
+			}
+		} else if ((ir.ineed[i] & REGM_PSW)
+			   && (o->alu == 0 || (alu_fuse[o->alu] & FLAG_NOTCY)))
+			return 1;
+		else if (o->alu && (alu_fset[o->alu] & FLAG_NOTCY) == FLAG_NOTCY)
+			return 0;
+		if (i == blocks[b].last)
+			break;
+	}
+	if (blocks[b].exit)
+		return 1;
+	for (k = 0; k < 2; k++)
+		if (blocks[b].succ[k]
+		    && notcy_read(blocks[b].succ[k], seen, d))
+			return 1;
+	return 0;
+}
+
+static int djnz_safe(unsigned int d)
+{
+	struct block *b = blocks + blockof[d];
+	uint8_t *seen = zalloc(nblocks);
+	unsigned int k;
+
+	if (b->exit)
+		return 0;
+	for (k = 0; k < 2; k++)
+		if (b->succ[k] && notcy_read(b->succ[k], seen, d))
+			return 0;
+	return 1;
+}
+
+static void relative_branches(void)
+{
+	uint32_t *addr;
+	uint32_t a = 0;
+	unsigned int i, n, k;
+
+	if (!(ctx->cpu->ops & OP_Z80))
+		return;
+	build_cfg();
+	addr = zalloc(ir.count * sizeof(uint32_t));
+	for (i = ir.next[0]; i; i = ir.next[i]) {
+		addr[i] = a;
+		a += (OPINFO(i)->flags & OP_DATA) ? 0x10000 : OPINFO(i)->bytes;
+	}
+	for (i = ir.next[0]; i; i = n) {
+		const char *op = OPINFO(i)->op;
+		const char *p = ir.op[i];
+		const char *e = p + ir.oplen[i];
+		unsigned int s = i;
+		const char *to = NULL;
+		int32_t d;
+		char *t;
+
+		n = ir.next[i];
+		if (!(OPINFO(i)->flags & OP_BRA) || ir.target[i] == NULL)
+			continue;
+		/* DCR B; JNZ becomes DJNZ if nobody wants the flags */
+		if (strcmp(op, "JNZ") == 0 && ir.label[i] == NULL
+		    && op_is(ir.prev[i], "DCR", REG_B, REG_B)
+		    && djnz_safe(ir.prev[i])) {
+			s = ir.prev[i];
+			to = "DJNZ";
+		} else {
+			for (k = 0; relops[k][0]; k++)
+				if (strcmp(op, relops[k][0]) == 0)
+					to = relops[k][1];
+		}
+		if (to == NULL)
+			continue;
+		d = addr[ir.target[i]->instruction] - (addr[s] + 2);
+		if (d < -128 || d > 127
+		    || cost_op(find_operation(to), 0) > cost(i) +
+		       (s != i ? cost(s) : 0))
+			continue;
+		while (p < e && !isspace(*p))
+			p++;
+		t = zalloc(strlen(to) + (e - p) + 1);
+		sprintf(t, "%s%.*s", to, (int)(e - p), p);
+		trace("Relative %.*s\n", ir.oplen[i], ir.op[i]);
+		set_text(s, t);
+		if (s != i)
+			eliminate_instruction(i);
+	}
+}
+
+/*
+ *	ACK works out the address of a local afresh for each access with
+ *	LXI H,nn; DAD SP. If HL already points into the frame close by we can
+ *	step it there instead, which leaves the carry alone as well.
+ */
+static void reuse_frame_addresses(void)
+{
+	unsigned int i, n, k;
+
+	for (i = ir.next[0]; i; i = n) {
+		unsigned int p = ir.prev[i];
+		int d;
+		unsigned int steps;
+
+		n = ir.next[i];
+		if (strcmp(OPINFO(i)->op, "LXI") || ir.dr[i] != REG_H
+		    || ir.sym[i] || ir.addrconst[i] == CONST_UNKNOWN
+		    || ir.label[i] || n == 0 || ir.label[n]
+		    || strcmp(OPINFO(n)->op, "DAD") || ir.sr[n] != REG_SP
+		    || !(ir.flags[p] & HL_SPBIAS)
+		    || ir.spbias[p] == BIAS_UNKNOWN
+		    || (ir.need[n] & REGM_PSW))
+			continue;
+		d = (int16_t)ir.addrconst[i] - ir.spbias[p] - ir.hlbias[p];
+		steps = d < 0 ? -d : d;
+		if (steps * cost_op(find_operation("INX"), 0) > cost(i) + cost(n))
+			continue;
+		trace("Frame address %.*s from %d\n", ir.oplen[i], ir.op[i], d);
+		n = ir.next[n];
+		eliminate_instruction(ir.prev[n]);
+		if (d == 0) {
+			eliminate_instruction(i);
+			continue;
+		}
+		set_text(i, d > 0 ? "INX H" : "DEX H");
+		for (k = 1; k < steps; k++)
+			add_op1(i, d > 0 ? "INX" : "DEX");
+	}
+}
+
+/*
+ *	Dead stores. Within a block we walk backwards keeping the bytes that
+ *	are written again before anything can read them, and a store to bytes
+ *	that are all in the set can go. Globals are placed by symbol and
+ *	offset, and only if the file defines them and doesn't export them.
+ *	Stack slots are placed by their offset from the SP we were entered
+ *	with, so at a return everything below that is dead. Anything we can't
+ *	place is assumed to read all of memory.
+ */
+#define LOC_NONE	0
+#define LOC_SYM		1
+#define LOC_STACK	2
+#define LOC_ANY		3
+
+struct memref {
+	uint8_t kind;
+	uint8_t size;
+	uint16_t sym;
+	int32_t off;
+};
+
+#define MAX_DEAD	32
+
+struct deadset {
+	unsigned int n;
+	uint8_t frame;			/* Everything below the entry SP */
+	struct memref b[MAX_DEAD];	/* Single bytes */
+};
+
+static int dead_byte(struct deadset *d, struct memref *m, int32_t off)
+{
+	unsigned int n;
+	if (m->kind == LOC_STACK && d->frame && off < 0)
+		return 1;
+	for (n = 0; n < d->n; n++)
+		if (d->b[n].kind == m->kind && d->b[n].sym == m->sym
+		    && d->b[n].off == off)
+			return 1;
+	return 0;
+}
+
+static int dead_store(struct deadset *d, struct memref *m)
+{
+	unsigned int n;
+	if (m->kind != LOC_SYM && m->kind != LOC_STACK)
+		return 0;
+	for (n = 0; n < m->size; n++)
+		if (!dead_byte(d, m, m->off + n))
+			return 0;
+	return 1;
+}
+
+static void dead_write(struct deadset *d, struct memref *m)
+{
+	unsigned int n;
+	if (m->kind != LOC_SYM && m->kind != LOC_STACK)
+		return;
+	for (n = 0; n < m->size && d->n < MAX_DEAD; n++) {
+		if (dead_byte(d, m, m->off + n))
+			continue;
+		d->b[d->n] = *m;
+		d->b[d->n].off = m->off + n;
+		d->n++;
+	}
+}
+
+static void dead_read(struct deadset *d, struct memref *m)
+{
+	unsigned int n, k;
+	if (m->kind == LOC_NONE)
+		return;
+	if (m->kind == LOC_ANY) {
+		d->n = 0;
+		d->frame = 0;
+		return;
+	}
+	if (m->kind == LOC_STACK)
+		d->frame = 0;
+	for (n = 0; n < d->n; ) {
+		struct memref *b = d->b + n;
+		if (b->kind == m->kind && b->sym == m->sym
+		    && b->off >= m->off && b->off < m->off + m->size) {
+			for (k = n + 1; k < d->n; k++)
+				d->b[k - 1] = d->b[k];
+			d->n--;
+		} else
+			n++;
+	}
+}
+
+static void memref_set(struct memref *m, int kind, unsigned int sym,
+		       int32_t off, unsigned int size)
+{
+	m->kind = kind;
+	m->sym = sym;
+	m->off = off;
+	m->size = size;
+}
+
+/* A global we can track or somewhere we can't */
+static void memref_sym(struct memref *m, unsigned int sym, int32_t off,
+		       unsigned int size)
+{
+	if (sym && symlocal[sym])
+		memref_set(m, LOC_SYM, sym, off, size);
+	else
+		memref_set(m, LOC_ANY, 0, 0, size);
+}
+
+/* Where a pair points. We follow stack addresses ourselves and use the
+   value tracking for symbols */
+static void memref_pair(struct memref *m, unsigned int e, int reg,
+			struct memref *track, unsigned int size)
+{
+	if (track && track->kind == LOC_STACK) {
+		*m = *track;
+		m->size = size;
+	} else if (know_pair_sym(e, reg))
+		memref_sym(m, reg_sym(e, reg)->sym, (int16_t)reg_sym(e, reg)->off,
+			   size);
+	else
+		memref_set(m, LOC_ANY, 0, 0, size);
+}
+
+/* Do we trust the stack bias after an instruction that changes SP */
+static int sp_tracked(unsigned int i)
+{
+	const char *op = OPINFO(i)->op;
+	if (ir.spbias[i] == BIAS_UNKNOWN)
+		return 0;
+	if (strcmp(op, "PUSH") == 0 || strcmp(op, "POP") == 0
+	    || strcmp(op, "INX") == 0 || strcmp(op, "DEX") == 0
+	    || strcmp(op, "DCX") == 0)
+		return 1;
+	return strcmp(op, "SPHL") == 0 && (ir.flags[ir.prev[i]] & HL_SPBIAS);
+}
+
+/* Work out what each instruction of a block reads and writes */
+static void block_memrefs(unsigned int first, unsigned int last,
+			  struct memref *rd, struct memref *wr, uint8_t *store)
+{
+	struct memref hl, de, t;
+	unsigned int i, p;
+	int biasok = 1;
+
+	hl.kind = de.kind = LOC_NONE;
+	for (i = first; ; i = ir.next[i]) {
+		struct optab *o = OPINFO(i);
+		const char *op = o->op;
+		int32_t bias = ir.spbias[ir.prev[i]];
+		unsigned int size = 1;
+
+		p = ir.prev[i];
+		if (bias == BIAS_UNKNOWN)
+			biasok = 0;
+		rd[i].kind = wr[i].kind = LOC_NONE;
+		store[i] = 0;
+
+		if (strcmp(op, "LHLD") == 0 || strcmp(op, "SHLD") == 0)
+			size = 2;
+		if ((o->flags & OP_ADDR) && !(o->flags & OP_SPAIR)) {
+			memref_sym(op[0] == 'S' ? wr + i : rd + i, ir.sym[i],
+				   (int16_t)ir.symoff[i], size);
+			store[i] = op[0] == 'S';
+		} else if (strcmp(op, "LDAX") == 0 || strcmp(op, "STAX") == 0) {
+			memref_pair(op[0] == 'S' ? wr + i : rd + i, p, ir.sr[i],
+				    ir.sr[i] == REG_D ? &de : NULL, 1);
+			store[i] = op[0] == 'S';
+		} else if (strcmp(op, "LHLX") == 0 || strcmp(op, "SHLX") == 0) {
+			memref_pair(op[0] == 'S' ? wr + i : rd + i, p, REG_D,
+				    &de, 2);
+			store[i] = op[0] == 'S';
+		} else if (((o->flags & OP_MOV) || (o->flags & OP_MVI))
+			   && ir.dr[i] == MEM_HL) {
+			memref_pair(wr + i, p, REG_H, &hl, 1);
+			store[i] = 1;
+		} else if (((o->flags & (OP_MOV | OP_AOP | OP_REGMOD))
+			    && (ir.sr[i] == MEM_HL || ir.dr[i] == MEM_HL)))
+			memref_pair(rd + i, p, REG_H, &hl, 1);
+		else if (strcmp(op, "PUSH") == 0 && biasok)
+			memref_set(wr + i, LOC_STACK, 0, -(bias + 2), 2);
+		else if (strcmp(op, "POP") == 0 && biasok)
+			memref_set(rd + i, LOC_STACK, 0, -bias, 2);
+		else if ((o->flags & (OP_CALL | OP_RET | OP_KEEP))
+			 || (ir.iset[i] & MEMORYM)
+			 || ((ir.iset[i] & REGM_SP) && !sp_tracked(i))
+			 || strcmp(op, "XTHL") == 0 || strcmp(op, "PCHL") == 0)
+			memref_set(rd + i, LOC_ANY, 0, 0, 2);
+		if (strcmp(op, "RET") == 0)
+			rd[i].kind = LOC_NONE;
+
+		/* Follow what HL and DE point at */
+		if ((ir.iset[i] & REGM_SP) && !sp_tracked(i))
+			biasok = 0;
+		if (strcmp(op, "DAD") == 0 && ir.sr[i] == REG_SP) {
+			hl.kind = LOC_NONE;
+			if (biasok && know_pair_value(p, REG_H))
+				memref_set(&hl, LOC_STACK, 0,
+					   (int16_t)pair_value(p, REG_H) - bias, 1);
+		} else if (strcmp(op, "LDSI") == 0) {
+			de.kind = LOC_NONE;
+			if (biasok && ir.addrconst[i] != CONST_UNKNOWN)
+				memref_set(&de, LOC_STACK, 0,
+					   ir.addrconst[i] - bias, 1);
+		} else if ((o->flags & OP_PAIRMOD) && ir.dr[i] == REG_H
+			   && hl.kind == LOC_STACK)
+			hl.off += strcmp(op, "INX") ? -1 : 1;
+		else if ((o->flags & OP_PAIRMOD) && ir.dr[i] == REG_D
+			 && de.kind == LOC_STACK)
+			de.off += strcmp(op, "INX") ? -1 : 1;
+		else if (strcmp(op, "XCHG") == 0) {
+			t = hl;
+			hl = de;
+			de = t;
+		} else {
+			if (ir.iset[i] & (REGM_H | REGM_L))
+				hl.kind = LOC_NONE;
+			if (ir.iset[i] & (REGM_D | REGM_E))
+				de.kind = LOC_NONE;
+		}
+		if (i == last)
+			break;
+	}
+}
+
+/* The stack bias is carried down the code in order, so it is only right
+   at a label if every jump there agrees and nothing else can get there */
+static int bias_consistent(void)
+{
+	unsigned int i;
+
+	link_labels();
+	for (i = ir.next[0]; i; i = ir.next[i]) {
+		struct label *l = ir.target[i];
+		if (ir.spbias[i] == BIAS_UNKNOWN
+		    || (ir.label[i] && ir.label[i]->entry && i != ir.next[0]))
+			return 0;
+		if (l && ir.spbias[i] != ir.spbias[ir.prev[l->instruction]])
+			return 0;
+	}
+	return 1;
+}
+
+static void eliminate_dead_stores(void)
+{
+	struct memref *rd = zalloc(ir.count * sizeof(struct memref));
+	struct memref *wr = zalloc(ir.count * sizeof(struct memref));
+	uint8_t *store = zalloc(ir.count);
+	struct deadset d;
+	unsigned int i, first, last;
+	int biassure;
+
+	find_local_symbols();
+	/* The return can only free the frame if we know where SP is at every
+	   label */
+	biassure = bias_consistent();
+
+	for (first = ir.next[0]; first; first = ir.next[last]) {
+		for (last = first; ir.next[last]; last = ir.next[last])
+			if (ends_block(last) || ir.label[ir.next[last]])
+				break;
+		block_memrefs(first, last, rd, wr, store);
+		d.n = 0;
+		d.frame = biassure && strcmp(OPINFO(last)->op, "RET") == 0
+			&& ir.spbias[ir.prev[last]] == 0;
+		for (i = last; ; i = ir.prev[i]) {
+			if (store[i] && dead_store(&d, wr + i)) {
+				trace("Dead store %.*s\n", ir.oplen[i], ir.op[i]);
+				eliminate_instruction(i);
+			} else {
+				dead_write(&d, wr + i);
+				dead_read(&d, rd + i);
+			}
+			if (i == first)
+				break;
+		}
+	}
+}
+
+/*
+ *	Spills. ACK saves values with PUSH and POP even when there is a pair
+ *	free to hold them. Look for a PUSH and the POP that undoes it in the
+ *	same block and use a pair nobody wants in between instead. Frame
+ *	offsets taken in between are 2 out once the push has gone, so the LXI
+ *	before each DAD SP is adjusted and we give up if we can't do that.
+ */
+#define MAX_SPFIX	8
+
+static unsigned int spill_pop(unsigned int i, unsigned int *fix,
+			      unsigned int *nfix)
+{
+	unsigned int k, p;
+	int depth = 0;
+
+	*nfix = 0;
+	for (k = ir.next[i]; k; k = ir.next[k]) {
+		const char *op = OPINFO(k)->op;
+		if (ir.label[k])
+			return 0;
+		if (strcmp(op, "PUSH") == 0)
+			depth++;
+		else if (strcmp(op, "POP") == 0) {
+			if (depth == 0)
+				return k;
+			depth--;
+		} else if (strcmp(op, "DAD") == 0 && ir.sr[k] == REG_SP) {
+			int16_t off;
+			p = ir.prev[k];
+			if (p == i || strcmp(OPINFO(p)->op, "LXI")
+			    || ir.dr[p] != REG_H || ir.sym[p]
+			    || ir.addrconst[p] == CONST_UNKNOWN)
+				return 0;
+			/* Pushes since ours move with SP, anything beyond our
+			   slot doesn't and we can't have our slot itself */
+			off = ir.addrconst[p];
+			if (off >= 2 * depth - 1 && off < 2 * depth + 2)
+				return 0;
+			if (off >= 2 * depth + 2) {
+				if (*nfix == MAX_SPFIX)
+					return 0;
+				fix[(*nfix)++] = p;
+			}
+		} else if ((ir.ineed[k] | ir.iset[k]) & REGM_SP)
+			return 0;
+		if (ends_block(k) || (OPINFO(k)->flags & OP_CALL))
+			return 0;
+	}
+	return 0;
+}
+
+static void eliminate_spills(void)
+{
+	static const int pairs[] = { REG_B, REG_D, REG_H };
+	unsigned int i, j, k, n;
+	unsigned int fix[MAX_SPFIX], nfix;
+
+	for (i = ir.next[0]; i; i = ir.next[i]) {
+		int x = ir.sr[i], y, q = 0;
+		uint32_t used = 0, live = 0;
+		unsigned int old, new;
+		int xchg;
+
+		if (strcmp(OPINFO(i)->op, "PUSH") || x == REG_PSW)
+			continue;
+		j = spill_pop(i, fix, &nfix);
+		if (j == 0 || (y = ir.dr[j]) == REG_PSW)
+			continue;
+		/* What is written and what is wanted over the range */
+		for (k = i; k != j; k = ir.next[k]) {
+			live |= ir.need[k];
+			if (k != i)
+				used |= ir.iset[k];
+		}
+		/* If nothing changed it we can just leave it where it is,
+		   otherwise find a free pair, the one we pop into if we can */
+		if (x == y && !(used & PairMask(x)))
+			q = x;
+		else for (n = 0; n < 3; n++) {
+			int r = pairs[n];
+			if ((used | live) & PairMask(r))
+				continue;
+			if (q == 0 || r == y)
+				q = r;
+		}
+		if (q == 0)
+			continue;
+		/* Moving HL to DE or back is an XCHG if we can lose the source */
+		xchg = ((x == REG_H && q == REG_D) || (x == REG_D && q == REG_H))
+			&& !(ir.need[i] & PairMask(x));
+		old = cost(i) + cost(j);
+		new = 0;
+		if (q != y)
+			new += 2 * cost_text("MOV B,C");
+		if (xchg)
+			new += cost_text("XCHG");
+		else if (q != x)
+			new += 2 * cost_text("MOV B,C");
+		if (new > old)
+			continue;
+		trace("Spill %.*s into %c\n", ir.oplen[i], ir.op[i],
+		      regname(q));
+		for (n = 0; n < nfix; n++) {
+			char *t = zalloc(16);
+			sprintf(t, "LXI H,%d", (int16_t)ir.addrconst[fix[n]] - 2);
+			set_text(fix[n], t);
+		}
+		/* The pop first as the push may add after itself */
+		if (q == y)
+			eliminate_instruction(j);
+		else {
+			make_op2_r(j, "MOV", y, q);
+			add_op2_r(j, "MOV", y + 1, q + 1);
+		}
+		if (q == x)
+			eliminate_instruction(i);
+		else if (xchg)
+			set_text(i, "XCHG");
+		else {
+			make_op2_r(i, "MOV", q, x);
+			i = add_op2_r(i, "MOV", q + 1, x + 1);
+		}
+	}
+}
+
+static void parse_statement(const char *p, const char *e)
+{
+	unsigned int i;
+	struct label *l;
+
+	const char *x = p;
+	const char *lab = NULL;
+	unsigned int lablen = 0;
+	/* Look for a label */
+	while (x < e && *x != '\'' && *x != '\"') {
+		if (*x == ':') {
+			lab = p;
+			lablen = x - p;
+			p = x + 1;
+			break;
+		}
+		x++;
+	}
+	/* Now deal with the post label stuff */
+	while (p < e && isspace(*p))
+		p++;
+	while (e > p && isspace(e[-1]))
+		e--;
+
+	if (p == e && !lab)
+		return;
+
+	i = new_instruction();
+	ir.op[i] = p;
+	ir.oplen[i] = e - p;
+	if (lab) {
+		l = new_label();
+		l->name = lab;
+		l->namelen = lablen;
+		l->next = NULL;
+		l->sym = find_symbol(lab, lablen);
+		l->instruction = i;
+		ir.label[i] = l;
+		/* TODO: for now take the simple approach - any label invalidates
+		   all known values. We can improve on this later */
+		invalidate_regs(ir.prev[i]);
+	}
+	parse_instruction(i);
+}
+
+/* Statements are split by ; and a ! starts a comment, except in quotes */
+static void parse_line(const char *p, unsigned int len)
+{
+	const char *e = p + len;
+	const char *x = p;
+	char q = 0;
+
+	while (x < e) {
+		if (q) {
+			if (*x == '\\')
+				x++;
+			else if (*x == q)
+				q = 0;
+		} else if (*x == '\'' || *x == '"')
+			q = *x;
+		else if (*x == ';' || *x == '!') {
+			parse_statement(p, x);
+			if (*x == '!')
+				return;
+			p = x + 1;
+		}
+		x++;
+	}
+	parse_statement(p, e);
+}
+
+static void dump_debug(void)
+{
+	unsigned int i = ir.next[0];
+	while (i) {
+		if (ir.dead[i])
+			fprintf(ctx->out, "---- BEGIN DEAD ----\n");
+		print_regmap(ir.need[ir.prev[i]]);
+		fprintf(ctx->out, "\n");
+		if (ir.label[i])
+			fprintf(ctx->out, "%.*s:", ir.label[i]->namelen,
+				ir.label[i]->name);
+		fprintf(ctx->out, "%.*s\n", ir.oplen[i], ir.op[i]);
+		print_regmap(ir.set[i]);
+		fprintf(ctx->out, "\n");
+		print_values(i);
+		fprintf(ctx->out, "\n");
+
+		if (ir.dead[i])
+			fprintf(ctx->out, "----  END DEAD  ----\n");
+		
+		i = ir.next[i];
+	}
+}
+
+/* Write the code back out. Anything we didn't change is the input text */
+static void dump_output(void)
+{
+	unsigned int i, base;
+
+	if (ctx->debug) {
+		dump_debug();
+		return;
+	}
+	if (holding) {
+		base = noutlines;
+		for (i = ir.next[0]; i; i = ir.next[i])
+			hold_line(i);
+		keep_tails(base);
+		return;
+	}
+	for (i = ir.next[0]; i; i = ir.next[i]) {
+		if (ir.label[i])
+			fprintf(ctx->out, "%.*s:", ir.label[i]->namelen,
+				ir.label[i]->name);
+		if (ir.oplen[i])
+			fprintf(ctx->out, "\t%.*s", ir.oplen[i], ir.op[i]);
+		fputc('\n', ctx->out);
+	}
+}
+
+/*
+ *	The input is kept in memory for the whole run and the IR points
+ *	straight into it. Files are mapped, pipes are read in big blocks into
+ *	a buffer we keep for the next file.
+ */
+static PERTHREAD void *map_base;
+static PERTHREAD size_t map_len;
+static PERTHREAD char *readbuf;
+static PERTHREAD size_t readsize;
+
+#define READ_BLOCK	65536
+
+static const char *read_input(FILE *fp, size_t *len)
+{
+	struct stat st;
+	int fd = fileno(fp);
+	size_t n = 0;
+	ssize_t r;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		map_base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map_base != MAP_FAILED) {
+			map_len = st.st_size;
+			*len = map_len;
+			return map_base;
+		}
+		map_base = NULL;
+	}
+	while (1) {
+		if (readsize - n < READ_BLOCK) {
+			readsize += READ_BLOCK * 4;
+			readbuf = realloc(readbuf, readsize);
+			if (readbuf == NULL)
+				fail("Out of memory.");
+		}
+		r = read(fd, readbuf + n, readsize - n);
+		if (r == 0)
+			break;
+		if (r < 0)
+			fail("read: %s", strerror(errno));
+		n += r;
+	}
+	*len = n;
+	return readbuf;
+}
+
+static void release_input(void)
+{
+	if (map_base)
+		munmap(map_base, map_len);
+	map_base = NULL;
+}
+
+/*
+ *	Rewrite rules. These come from the superoptimizer below. Each rule
+ *	is a short run of register only instructions and a cheaper run that
+ *	does the same, perhaps only when the flags are not needed after it.
+ *	Constants are part of the match, symbols and memory are not allowed.
+ *	The rules are hashed on the opcodes and operands of the run so we can
+ *	look up each window of the code quickly.
+ */
+#define MAX_RULE	4
 
-	if (op == NULL)
-		error("label alone not supported");
+struct sop {
+	uint8_t opcode;
+	uint8_t dr, sr;
+	uint16_t imm;		/* Constant for MVI, LXI and the like */
+};
 
-	/* Should be an 8085 op code but might be meta stuff */
-	o = find_operation(op);
-	if (o == NULL) {
-		fprintf(stderr, "%d: Unknown operation '%s'.\n", linenum,
-			op);
-		exit(1);
+struct rule {
+	struct rule *next;
+	uint8_t len, rlen;
+	uint8_t flagsdead;
+	struct sop from[MAX_RULE];
+	struct sop to[MAX_RULE];
+};
+
+#define RULEHASH_SIZE	4096
+
+
+static unsigned int hash_sops(const struct sop *o, unsigned int len)
+{
+	unsigned int h = len;
+	while (len--) {
+		h = h * 31 + o->opcode;
+		h = h * 31 + o->dr;
+		h = h * 31 + o->sr;
+		h = h * 31 + o->imm;
+		o++;
 	}
+	return h & (RULEHASH_SIZE - 1);
+}
 
-	i->prev->need = o->imask;
-	i->next->set = o->omask;
-	i->opinfo = o;
-	i->opcode = op;		/* FIXME: would be better as a code */
+static void sop_text(char *buf, const struct sop *o);
 
-	/* Register to register move, 8 bit */
-	if (o->flags & OP_MOV) {
-		ParseR8Pair(&l, &r);
-		/* We need the source, we set the dest */
-		i->prev->need |= (1 << r);
-		i->next->set |= (1 << l);
-		i->sr = r;
-		i->dr = l;
+/* Fill in a sop from an instruction. Fails if it names memory or a symbol
+   or has a constant we don't know */
+static int make_sop(struct sop *o, unsigned int i)
+{
+	if (ir.sym[i] || ((ir.set[i] | ir.ineed[i])
+		& (REGM_SP | MEMORYM | MEMM_HL | MEMM_HL_W | SIDEEFFECTM)))
+		return 0;
+	o->opcode = ir.opcode[i];
+	o->dr = ir.dr[i];
+	o->sr = ir.sr[i];
+	o->imm = 0;
+	if (OPINFO(i)->flags & (OP_MVI | OP_IMMED)) {
+		if (ir.addrconst[i] == CONST_UNKNOWN)
+			return 0;
+		o->imm = ir.addrconst[i];
 	}
-	/* Immediate to register move, 8bit */
-	if (o->flags & OP_MVI) {
-		ParseR8Const(&l, &r);
-		i->next->set = (1 << l);
-		i->dr = l;
-		i->addrconst = r;
+	return 1;
+}
+
+static int same_sop(const struct sop *a, const struct sop *b)
+{
+	return a->opcode == b->opcode && a->dr == b->dr && a->sr == b->sr
+		&& a->imm == b->imm;
+}
+
+/* Split a run of instructions and parse them the same way as the input.
+   Each one must come back the same when we write it out again */
+static unsigned int parse_sops(char *p, struct sop *o)
+{
+	unsigned int n = 0;
+	char *t;
+	char buf[16];
+	struct sop c;
+
+	while ((t = strtok(p, ";\n")) != NULL) {
+		unsigned int i;
+		p = NULL;
+		while (isspace(*t))
+			t++;
+		if (*t == 0)
+			continue;
+		if (n == MAX_RULE)
+			error("rule too long");
+		i = ir_alloc();
+		set_text(i, t);
+		if (!make_sop(o + n, i))
+			error("rules may only use registers and constants");
+		sop_text(buf, o + n);
+		set_text(i, buf);
+		if (!make_sop(&c, i) || !same_sop(&c, o + n))
+			error("instruction not supported in a rule");
+		n++;
 	}
-	/* General immediates */
-	if (o->flags & OP_IMMED) {
-		/* 16bit source/destinations eg lxi */
-		if (o->flags & (OP_SPAIR | OP_DPAIR)) {
-			ParsePairConst(&l, &r);
-			if (o->flags & OP_SPAIR) {
-				i->sr = l;
-				i->prev->need |= PairMask(l);
-			} else {
-				i->dr = l;
-				i->next->set |= PairMask(l);
-				/* For a destination update the constant value */
-				if (r != CONST_UNKNOWN)
-					set_pair_value(i->next, i->dr, r);
-			}
-			i->addrconst = r;
+	return n;
+}
+
+/* Lines are "- from = to" or "F from = to" for rules that need the flags
+   to be dead afterwards */
+static void load_rules(const char *name)
+{
+	FILE *fp = fopen(name, "r");
+	char buf[256];
+
+	if (fp == NULL)
+		fail("%s: %s", name, strerror(errno));
+	ctx->rulefp = fp;
+	while (fgets(buf, sizeof(buf), fp)) {
+		struct rule nr, *r;
+		char *eq = strchr(buf, '=');
+		unsigned int h;
+
+		linenum++;
+		if (*buf == '#' || eq == NULL)
+			continue;
+		ctx->rulesum = hash_bytes(ctx->rulesum, buf, strlen(buf));
+		*eq++ = 0;
+		nr.flagsdead = *buf == 'F';
+		nr.len = parse_sops(buf + 1, nr.from);
+		nr.rlen = parse_sops(eq, nr.to);
+		ir_reset();
+		arena_reset();
+		if (nr.len == 0)
+			continue;
+		r = malloc(sizeof(struct rule));
+		if (r == NULL)
+			fail("Out of memory.");
+		*r = nr;
+		h = hash_sops(r->from, r->len);
+		r->next = ctx->rulehash[h];
+		ctx->rulehash[h] = r;
+		ctx->nrules++;
+	}
+	ctx->rulefp = NULL;
+	fclose(fp);
+	linenum = 0;
+}
+
+static void sop_text(char *buf, const struct sop *o)
+{
+	struct optab *op = ops + o->opcode;
+
+	if (op->flags & OP_MOV)
+		sprintf(buf, "%s %c,%c", op->op, regname(o->dr), regname(o->sr));
+	else if ((op->flags & OP_MVI)
+		 || (op->flags & (OP_IMMED | OP_DPAIR)) == (OP_IMMED | OP_DPAIR))
+		sprintf(buf, "%s %c,%u", op->op, regname(o->dr), o->imm);
+	else if (op->flags & OP_IMMED)
+		sprintf(buf, "%s %u", op->op, o->imm);
+	else if (op->flags & (OP_REGMOD | OP_PAIRMOD))
+		sprintf(buf, "%s %c", op->op, regname(o->dr));
+	else if (op->flags & (OP_AOP | OP_SPAIR))
+		sprintf(buf, "%s %c", op->op, regname(o->sr));
+	else
+		strcpy(buf, op->op);
+}
+
+static struct rule *find_rule_sops(const struct sop *w, unsigned int len)
+{
+	struct rule *r;
+	unsigned int n;
+
+	for (r = ctx->rulehash[hash_sops(w, len)]; r; r = r->next) {
+		if (r->len != len)
+			continue;
+		for (n = 0; n < len && same_sop(r->from + n, w + n); n++);
+		if (n == len)
+			return r;
+	}
+	return NULL;
+}
+
+static struct rule *find_rule(unsigned int i, unsigned int len)
+{
+	struct sop w[MAX_RULE];
+	unsigned int n;
+
+	for (n = 0; n < len; n++, i = ir.next[i]) {
+		if (i == 0 || (n && ir.label[i]) || !make_sop(w + n, i))
+			return NULL;
+	}
+	return find_rule_sops(w, len);
+}
+
+/* Replace each window that matches a rule, longest rules first */
+static void apply_rules(void)
+{
+	unsigned int i = ir.next[0];
+	char buf[16];
+
+	if (ctx->nrules == 0)
+		return;
+	while (i) {
+		struct rule *r = NULL;
+		unsigned int len, n, x, last, atlen;
+		const char *at;
+
+		for (len = MAX_RULE; len >= 2 && r == NULL; len--)
+			r = find_rule(i, len);
+		if (r == NULL) {
+			i = ir.next[i];
+			continue;
 		}
-		/* Arithmetic/logic op 8bit with immediate */
-		if (o->flags & OP_AOP) {
-			ParseConst(&l);
-			/* This is a simplification. Strictly speaking AND 0, XOR 0 and
-			   OR 0xFF don't need the sr */
-			i->sr = i->dr = REG_A;
-			i->addrconst = l;
+		for (n = 1, last = i; n < r->len; n++)
+			last = ir.next[last];
+		/* The table is built with 8085 flags */
+		if ((r->flagsdead || ctx->cpu->fdiff)
+		    && (ir.need[last] & REGM_PSW)) {
+			i = ir.next[i];
+			continue;
 		}
-	} else {
-		/* reg pair as destination eg pop b */
-		/* We don't do any stack constant tracking but we probably should */
-		if (o->flags & OP_DPAIR) {
-			ParsePair(&l);
-			i->dr = l;
-			i->next->set |= PairMask(l);
+		/* Rewrite the start of the window and drop the rest */
+		at = ir.op[i];
+		atlen = ir.oplen[i];
+		ir_begin();
+		x = i;
+		for (n = 0; n < r->len; n++) {
+			unsigned int nx = ir.next[x];
+			if (n < r->rlen) {
+				sop_text(buf, r->to + n);
+				set_text(x, buf);
+			} else
+				eliminate_instruction(x);
+			x = nx;
 		}
-		/* reg pair as source - eg push b */
-		else if (o->flags & OP_SPAIR) {
-			ParsePair(&l);
-			i->sr = l;
-			/* DAD has an implicit destination */
-			if (strcasecmp(op, "DAD") == 0)
-				i->dr = REG_H;
-			i->prev->need |= PairMask(l);
+		/* As for replace_run(), only keep it if it is cheaper */
+		if (ir_cost_delta() >= 0) {
+			ir_rollback();
+			i = ir.next[i];
+			continue;
 		}
-		/* Arithmetic op without constant */
-		else if (o->flags & OP_AOP) {
-			ParseR8M(&l);
-			i->dr = REG_A;
-			i->sr = l;
-			i->prev->need |= (1 << l);
+		ir_commit();
+		trace("Rule at %.*s\n", atlen, at);
+		i = x;
+	}
+}
+
+/*
+ *	The superoptimizer. This runs offline and writes the rule table. It
+ *	tries every run of two or more register only instructions and looks
+ *	for a cheaper run of up to two that gives the same registers, and the
+ *	same flags unless the rule is only for when they are dead. Candidates
+ *	are found by hashing their results on a few test states and checked
+ *	by running both on a few thousand more. The instructions are run
+ *	with the same alu_eval() the optimizer folds constants with.
+ */
+struct sstate {
+	uint8_t r[8];
+	uint8_t f;
+};
+
+static void sim_op(struct sstate *s, const struct sop *o)
+{
+	struct optab *op = ops + o->opcode;
+	int alu = op->alu;
+	uint8_t f = s->f;
+	unsigned int v;
+
+	if (op->flags & OP_MOV) {
+		s->r[o->dr] = s->r[o->sr];
+		return;
+	}
+	if (alu == 0) {
+		/* XCHG */
+		uint8_t t = s->r[REG_D];
+		s->r[REG_D] = s->r[REG_H];
+		s->r[REG_H] = t;
+		t = s->r[REG_E];
+		s->r[REG_E] = s->r[REG_L];
+		s->r[REG_L] = t;
+		return;
+	}
+	if (alu == ALU_INX || alu == ALU_DCX) {
+		v = (s->r[o->dr] << 8 | s->r[o->dr + 1]) +
+		    (alu == ALU_INX ? 1 : 0xFFFF);
+		s->r[o->dr] = v >> 8;
+		s->r[o->dr + 1] = v;
+		return;
+	}
+	if (alu == ALU_DAD) {
+		v = (s->r[REG_H] << 8 | s->r[REG_L]) +
+		    (s->r[o->sr] << 8 | s->r[o->sr + 1]);
+		s->r[REG_H] = v >> 8;
+		s->r[REG_L] = v;
+		s->f = (s->f & ~FLAG_CY) | !!(v & 0x10000);
+		return;
+	}
+	if (alu == ALU_INR || alu == ALU_DCR)
+		s->r[o->dr] = alu_eval(alu, s->r[o->dr], 0, &f);
+	else
+		s->r[REG_A] = alu_eval(alu, s->r[REG_A], s->r[o->sr], &f);
+	s->f = (s->f & ~alu_fset[alu]) | (f & alu_fset[alu]);
+}
+
+/* The instructions we search over */
+static PERTHREAD struct sop alphabet[160];
+static PERTHREAD unsigned int nalpha;
+
+static void add_alpha(const char *m, int dr, int sr)
+{
+	alphabet[nalpha].opcode = find_operation(m) - ops;
+	alphabet[nalpha].dr = dr;
+	alphabet[nalpha].sr = sr;
+	nalpha++;
+}
+
+static void build_alphabet(void)
+{
+	static const char *aop[] = {
+		"ADD", "ADC", "SUB", "SBB", "ANA", "XRA", "ORA", "CMP", NULL
+	};
+	static const char *misc[] = {
+		"RLC", "RRC", "RAL", "RAR", "CMA", "STC", "CMC", "XCHG", NULL
+	};
+	int r, s, n;
+
+	nalpha = 0;
+	for (r = REG_A; r <= REG_L; r++) {
+		for (s = REG_A; s <= REG_L; s++)
+			if (r != s)
+				add_alpha("MOV", r, s);
+		add_alpha("INR", r, r);
+		add_alpha("DCR", r, r);
+		for (n = 0; aop[n]; n++)
+			add_alpha(aop[n], REG_A, r);
+	}
+	for (n = 0; misc[n]; n++)
+		add_alpha(misc[n], 0, 0);
+	for (r = REG_B; r <= REG_H; r += 2) {
+		add_alpha("INX", r, r);
+		add_alpha("DEX", r, r);
+		add_alpha("DAD", REG_H, r);
+	}
+}
+
+#define SO_TESTS	16
+#define SO_VERIFY	4096
+#define SO_HASH		65536
+
+static PERTHREAD struct sstate so_test[SO_VERIFY];
+
+struct cand {
+	uint64_t fp;
+	struct sop seq[2];
+	uint8_t len;
+	uint8_t bytes, cycles;
+};
+
+/* Cheapest candidate for each result fingerprint, with and without the
+   flags counted */
+static PERTHREAD struct cand *so_cand[2];
+
+static void so_states(void)
+{
+	static const uint8_t edge[] = { 0x00, 0x01, 0x0F, 0x10, 0x7F, 0x80,
+					0xFE, 0xFF };
+	uint32_t seed = 0x12345678;
+	unsigned int n, r;
+
+	for (n = 0; n < SO_VERIFY; n++) {
+		for (r = 0; r < 8; r++) {
+			seed = seed * 1103515245 + 12345;
+			/* Mix in the awkward values as well as random ones */
+			if (seed & 0x100000)
+				so_test[n].r[r] = edge[(seed >> 8) & 7];
+			else
+				so_test[n].r[r] = seed >> 16;
 		}
+		seed = seed * 1103515245 + 12345;
+		so_test[n].f = (seed >> 16) & FLAG_ALL;
 	}
-	/* Register modify - eg inr a */
-	if (o->flags & OP_REGMOD) {
-		ParseR8M(&l);
-		i->next->set |= (1 << l);
-		i->prev->need |= (1 << l);
-		i->dr = i->sr = l;
+}
+
+static void so_run(struct sstate *s, const struct sstate *in,
+		   const struct sop *seq, unsigned int len)
+{
+	*s = *in;
+	while (len--)
+		sim_op(s, seq++);
+}
+
+/* Fingerprint a run over the test states, regs only or regs and flags */
+static void so_fingerprint(const struct sop *seq, unsigned int len,
+			   uint64_t *fp)
+{
+	struct sstate s;
+	unsigned int n;
+
+	fp[0] = fp[1] = 0xCBF29CE484222325ULL;
+	for (n = 0; n < SO_TESTS; n++) {
+		so_run(&s, so_test + n, seq, len);
+		fp[0] = hash_bytes(fp[0], s.r + 1, 7);
+		fp[1] = hash_bytes(fp[1], s.r + 1, 7);
+		fp[1] = hash_bytes(fp[1], &s.f, 1);
 	}
-	/* Pair modify - eg inx b */
-	if (o->flags & OP_PAIRMOD) {
-		ParsePair(&l);
-		i->next->set |= PairMask(l);
-		i->prev->need |= PairMask(l);
-		i->dr = i->sr = l;
+}
+
+static int so_verify(const struct sop *a, unsigned int alen,
+		     const struct sop *b, unsigned int blen, int flags)
+{
+	struct sstate sa, sb;
+	unsigned int n;
+
+	for (n = 0; n < SO_VERIFY; n++) {
+		so_run(&sa, so_test + n, a, alen);
+		so_run(&sb, so_test + n, b, blen);
+		if (memcmp(sa.r + 1, sb.r + 1, 7))
+			return 0;
+		if (flags && sa.f != sb.f)
+			return 0;
 	}
-	/* Address target */
-	if (o->flags & OP_ADDR) {
-		ParseAddr(&l);
-		/* But do nothing with it yet */
-		i->addrconst = l;
+	return 1;
+}
+
+static void seq_costs(const struct sop *seq, unsigned int len,
+		      unsigned int *bytes, unsigned int *cycles)
+{
+	*bytes = *cycles = 0;
+	while (len--) {
+		*bytes += ops[seq->opcode].bytes;
+		*cycles += ctx->cycles[seq->opcode];
+		seq++;
+	}
+}
+
+static void so_add_cand(const struct sop *seq, unsigned int len)
+{
+	uint64_t fp[2];
+	unsigned int b, c, k;
+
+	so_fingerprint(seq, len, fp);
+	seq_costs(seq, len, &b, &c);
+	for (k = 0; k < 2; k++) {
+		unsigned int h = fp[k] & (SO_HASH - 1);
+		struct cand *x;
+		while (so_cand[k][h].len != 0xFF && so_cand[k][h].fp != fp[k])
+			h = (h + 1) & (SO_HASH - 1);
+		x = so_cand[k] + h;
+		if (x->len != 0xFF && (x->bytes < b
+				       || (x->bytes == b && x->cycles <= c)))
+			continue;
+		x->fp = fp[k];
+		x->len = len;
+		x->bytes = b;
+		x->cycles = c;
+		memcpy(x->seq, seq, len * sizeof(*seq));
+	}
+}
+
+static struct cand *so_find(uint64_t fp, int k)
+{
+	unsigned int h = fp & (SO_HASH - 1);
+	while (so_cand[k][h].len != 0xFF) {
+		if (so_cand[k][h].fp == fp)
+			return so_cand[k] + h;
+		h = (h + 1) & (SO_HASH - 1);
+	}
+	return NULL;
+}
+
+static void so_print(const struct sop *seq, unsigned int len)
+{
+	char buf[16];
+	unsigned int n;
+	for (n = 0; n < len; n++) {
+		sop_text(buf, seq + n);
+		fprintf(ctx->out, "%s%s", n ? "; " : " ", buf);
+	}
+}
+
+/* Does a shorter window of this run already have a rule */
+static int so_reducible(const struct sop *seq, unsigned int len)
+{
+	unsigned int l, n;
+	for (l = 2; l < len; l++)
+		for (n = 0; n + l <= len; n++)
+			if (find_rule_sops(seq + n, l))
+				return 1;
+	return 0;
+}
+
+static void so_emit(const struct sop *seq, unsigned int len,
+		    const struct cand *c, int flagsdead)
+{
+	struct rule *r = malloc(sizeof(struct rule));
+	unsigned int h = hash_sops(seq, len);
+
+	if (r == NULL)
+		fail("Out of memory.");
+	r->len = len;
+	r->rlen = c->len;
+	r->flagsdead = flagsdead;
+	memcpy(r->from, seq, len * sizeof(*seq));
+	memcpy(r->to, c->seq, c->len * sizeof(*seq));
+	r->next = ctx->rulehash[h];
+	ctx->rulehash[h] = r;
+	ctx->nrules++;
+
+	fputc(flagsdead ? 'F' : '-', ctx->out);
+	so_print(seq, len);
+	fprintf(ctx->out, " =");
+	so_print(c->seq, c->len);
+	fputc('\n', ctx->out);
+}
+
+static void so_try(const struct sop *seq, unsigned int len)
+{
+	uint64_t fp[2];
+	unsigned int b, c, k;
+
+	if (so_reducible(seq, len))
+		return;
+	so_fingerprint(seq, len, fp);
+	seq_costs(seq, len, &b, &c);
+	/* Try with the flags first as it is the more useful rule */
+	for (k = 2; k-- > 0; ) {
+		struct cand *x = so_find(fp[k], k);
+		if (x == NULL || x->bytes > b || x->cycles > c
+		    || (x->bytes == b && x->cycles == c))
+			continue;
+		if (so_verify(seq, len, x->seq, x->len, k)) {
+			so_emit(seq, len, x, !k);
+			return;
+		}
+	}
+}
+
+static void so_search(struct sop *seq, unsigned int n, unsigned int len)
+{
+	unsigned int a;
+	if (n == len) {
+		so_try(seq, len);
+		return;
+	}
+	for (a = 0; a < nalpha; a++) {
+		seq[n] = alphabet[a];
+		/* Anything with a reducible prefix is covered already */
+		if (n >= 1 && so_reducible(seq, n + 1) && n + 1 < len)
+			continue;
+		so_search(seq, n + 1, len);
+	}
+}
+
+static void superoptimize(unsigned int maxlen)
+{
+	struct sop seq[MAX_RULE];
+	unsigned int a, b, k, len;
+
+	if (maxlen < 2 || maxlen > MAX_RULE)
+		fail("search length must be 2 to %d.", MAX_RULE);
+	build_alphabet();
+	so_states();
+	for (k = 0; k < 2; k++) {
+		if (so_cand[k] == NULL)
+			so_cand[k] = malloc(SO_HASH * sizeof(struct cand));
+		if (so_cand[k] == NULL)
+			fail("Out of memory.");
+		for (a = 0; a < SO_HASH; a++)
+			so_cand[k][a].len = 0xFF;
+	}
+	/* Replacements of up to two instructions */
+	so_add_cand(seq, 0);
+	for (a = 0; a < nalpha; a++) {
+		seq[0] = alphabet[a];
+		so_add_cand(seq, 1);
+		for (b = 0; b < nalpha; b++) {
+			seq[1] = alphabet[b];
+			so_add_cand(seq, 2);
+		}
+	}
+	fprintf(ctx->out,
+		"# opt85 rules: flags live (-) or dead (F), from = to\n");
+	for (len = 2; len <= maxlen; len++)
+		so_search(seq, 0, len);
+}
+
+/* Run the passes over the function we have loaded */
+static void optimize(void)
+{
+	/* Set the need flags so we can do unused elimination */
+	trace("Propagate:\n");
+	propagate_need();
+	ir_compact();
+	/* Move constant loads out of loops */
+	trace("Loops:\n");
+	hoist_invariants();
+	ir_compact();
+	/* Simple constant propagation */
+	trace("Values:\n");
+	compute_values();
+	/* Operations that partially known values make pointless */
+	trace("Bits:\n");
+	simplify_bits();
+	ir_compact();
+	/* Operations we know the answer to */
+	trace("Fold:\n");
+	fold_constants();
+	ir_compact();
+	/* Multiplies and shifts by constants */
+	trace("Helpers:\n");
+	reduce_helpers();
+	ir_compact();
+	/* Passes leave work for the dead code removal */
+	reset_need();
+	propagate_need();
+	ir_compact();
+	compute_values();
+	/* Stores that are written again before anything reads them */
+	trace("Stores:\n");
+	eliminate_dead_stores();
+	ir_compact();
+	/* Values saved on the stack that could sit in a free pair */
+	trace("Spills:\n");
+	eliminate_spills();
+	ir_compact();
+	reset_need();
+	propagate_need();
+	ir_compact();
+	compute_values();
+	/* Undocumented 8085 instructions for runs ack writes out longhand */
+	trace("8085:\n");
+	use_8085();
+	reset_need();
+	propagate_need();
+	ir_compact();
+	compute_values();
+	/* Frame addresses HL nearly holds already */
+	trace("Frame:\n");
+	reuse_frame_addresses();
+	ir_compact();
+	reduce_dad_chains();
+	ir_compact();
+	/* Copies of values that are already there */
+	trace("Copies:\n");
+	eliminate_copies();
+	ir_compact();
+	/* Constant loads to register for 8bit operations */
+	trace("Immed8:\n");
+	adjust_immed8();
+	ir_compact();
+	trace("Immed16:\n");
+	adjust_immed16();
+	ir_compact();
+	/* Jump tables for switches */
+	trace("Switch:\n");
+	if (switch_tables()) {
+		reset_need();
+		propagate_need();
+	}
+	ir_compact();
+	/* Order the blocks so more branches fall through */
+	trace("Layout:\n");
+	layout_blocks();
+	ir_compact();
+	/* Rules from the superoptimizer */
+	trace("Rules:\n");
+	apply_rules();
+	ir_compact();
+	/* Tails the same as ones we have already */
+	trace("Cross:\n");
+	cross_jump();
+	ir_compact();
+	/* Short branches on a Z80 */
+	trace("Relative:\n");
+	relative_branches();
+	ir_compact();
+	/* Look for assignments we can move about and make into pair loads */
+	/* TODO move_assignments(); */
+	/* Check our fp/sp biasing model is consistent */
+	/* TODO validate_spbias(); */
+	/* Look for cases we can use ldhi ? */
+	trace("Dump:\n");
+	dump_output();
+}
+
+/* Forget the previous function. The input stays where it is */
+static void reset_function(void)
+{
+	ir_reset();
+	symbol_reset();
+	nextvn = 0;
+	nextlabel = 0;
+	analysed = 0;
+	spbias = 0;
+	arena_reset();
+}
+
+/* Forget the previous file. The arena and op hash are kept for the next */
+static void reset_state(void)
+{
+	reset_function();
+	linenum = 0;
+	datasect = 0;
+	file_names_reset();
+	release_output();
+	release_input();
+}
+
+/* Give back everything the thread keeps between files */
+static void release_memory(void)
+{
+	struct arena *a;
+
+	symbol_reset();
+	file_names_reset();
+	release_output();
+	release_input();
+	while ((a = arena_head) != NULL) {
+		arena_head = a->next;
+		free(a);
+	}
+	arena_cur = NULL;
+#define X(f)	free(ir.f);
+	IR_FIELDS
+#undef X
+	memset(&ir, 0, sizeof(ir));
+	free(jr.at);
+	free(jr.cost);
+	free(jr.rows);
+	free(jr.seen);
+	memset(&jr, 0, sizeof(jr));
+	free(ir_scratch);
+	free(ir_order);
+	ir_scratch = NULL;
+	ir_order = NULL;
+	ir_scratchsize = 0;
+	free(readbuf);
+	readbuf = NULL;
+	readsize = 0;
+	free(so_cand[0]);
+	free(so_cand[1]);
+	so_cand[0] = so_cand[1] = NULL;
+}
+
+/*
+ *	With a cache directory each function is remembered by a hash of its
+ *	text, the optimizer build and the options. A function we have seen
+ *	before is copied out without running any passes.
+ */
+#define CACHE_VERSION	"opt85 " __DATE__ " " __TIME__
+
+/* Case and spacing don't change the meaning so they don't change the key */
+static uint64_t hash_text(uint64_t h, const char *p, unsigned int len)
+{
+	int space = 0;
+	while (len--) {
+		uint8_t c = tolower(*p++);
+		if (isspace(c)) {
+			space = 1;
+			continue;
+		}
+		if (space)
+			h = hash_bytes(h, " ", 1);
+		space = 0;
+		h = hash_bytes(h, &c, 1);
+	}
+	return h;
+}
+
+/* Whether each name is defined or exported elsewhere in the file. The
+   passes look at that, so it is part of the key as well as the text */
+static uint8_t *name_flags(void)
+{
+	uint8_t *fl = zalloc(nsyms + 1);
+	struct symbol *sp;
+	struct fname *f;
+	unsigned int n;
+
+	for (n = 0; n < SYMHASH_SIZE; n++) {
+		for (sp = symhash[n]; sp; sp = sp->next) {
+			f = find_file_name(sp->name, sp->len);
+			if (f)
+				fl[sp->id] = f->flags;
+		}
+	}
+	return fl;
+}
+
+static uint64_t function_hash(void)
+{
+	uint64_t h = 0xCBF29CE484222325ULL;
+	uint8_t *fl = name_flags();
+	unsigned int i;
+
+	h = hash_bytes(h, CACHE_VERSION, strlen(CACHE_VERSION));
+	h = hash_bytes(h, &ctx->cost_bytes, sizeof(ctx->cost_bytes));
+	h = hash_bytes(h, &ctx->cost_cycles, sizeof(ctx->cost_cycles));
+	h = hash_bytes(h, &ctx->rulesum, sizeof(ctx->rulesum));
+	h = hash_bytes(h, &ctx->debug, sizeof(ctx->debug));
+	h = hash_bytes(h, ctx->cpu->name, strlen(ctx->cpu->name));
+	for (i = ir.next[0]; i; i = ir.next[i]) {
+		if (ir.label[i]) {
+			h = hash_bytes(h, ir.label[i]->name,
+				       ir.label[i]->namelen);
+			h = hash_bytes(h, ":", 1);
+			h = hash_bytes(h, fl + ir.label[i]->sym, 1);
+		}
+		h = hash_text(h, ir.op[i], ir.oplen[i]);
+		h = hash_bytes(h, fl + ir.sym[i], 1);
+		h = hash_bytes(h, "\n", 1);
+	}
+	return h;
+}
+
+static int copy_out(const char *name)
+{
+	FILE *fp = fopen(name, "r");
+	char buf[4096];
+	size_t n;
+
+	if (fp == NULL)
+		return 0;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		fwrite(buf, 1, n, ctx->out);
+	fclose(fp);
+	return 1;
+}
+
+/* Optimize into a private file and then publish it so that workers
+   sharing the cache never see a partial entry. Failures just mean we
+   don't cache */
+static void optimize_cached(void)
+{
+	char *name = zalloc(strlen(ctx->cachedir) + 40);
+	char *tmp = zalloc(strlen(ctx->cachedir) + 40);
+	FILE *out = ctx->out;
+	int err;
+
+	sprintf(name, "%s/%016llx", ctx->cachedir,
+		(unsigned long long)function_hash());
+	if (copy_out(name))
+		return;
+	sprintf(tmp, "%s.%d", name, (int)getpid());
+	ctx->cachefp = fopen(tmp, "w");
+	if (ctx->cachefp == NULL) {
+		optimize();
+		return;
 	}
+	ctx->cachetmp = tmp;
+	ctx->out = ctx->cachefp;
+	optimize();
+	ctx->out = out;
+	err = fclose(ctx->cachefp);
+	ctx->cachefp = NULL;
+	ctx->cachetmp = NULL;
+	if (err == 0 && copy_out(tmp) && rename(tmp, name) == 0)
+		return;
+	unlink(tmp);
+}
 
-	/* Save our direct needs so we can do eliminations easily */
-	i->set = i->next->set;
-	i->need = i->prev->need;
+static void flush_function(void)
+{
+	/* Rewrites are code whatever section the parser last saw */
+	int sect = datasect;
 
-	/* For now call/branch etc are treated as side effects so we don't
-	   remove any */
-	if (o->flags & (OP_RET | OP_CALL | OP_BRA))
-		i->next->set |= SIDEEFFECTM;
+	if (ir.next[0] == 0)
+		return;
+	datasect = 0;
+	if (ctx->cachedir)
+		optimize_cached();
+	else
+		optimize();
+	datasect = sect;
+	reset_function();
 }
 
+/* A label with a C name starts a new function */
+static int function_start(const char *p, const char *e)
+{
+	if (p == e || *p != '_')
+		return 0;
+	while (p < e && (isalnum(*p) || *p == '_' || *p == '.'))
+		p++;
+	return p < e && *p == ':';
+}
 
-/*
- *	Compute the actual register effects of an instruction
- */
-static void compute_effects(struct instruction *i)
+static int name_char(char c)
 {
-	const char *op = i->opcode;
-	int n;
+	return isalnum(c) || c == '_' || c == '.';
+}
 
-	if (i->opinfo->flags & OP_MOV) {
-		/* Propagate known constants */
-		if (know_reg_value(i->prev, i->sr))
-			set_reg_value(i->next, i->dr, reg_value(i->prev, i->sr));
-	}
-	if (i->opinfo->flags & OP_MVI)
-		set_reg_value(i->next, i->dr, i->addrconst);
+/* Note the labels and the names given to .define or .comm in a statement */
+static void scan_statement(const char *p, const char *e)
+{
+	const char *n;
 
-	if (i->opinfo->flags & OP_IMMED) {
-		if (i->opinfo->flags & OP_AOP)
-			set_reg_value(i->next, i->dr, i->addrconst);
-		else
-			set_pair_value(i->next, i->dr, i->addrconst);
-	}
-		
-	/* Calculate the stack/frame offset */
-	if (strcasecmp(op, "PUSH") == 0)
-		if (i->spbias != BIAS_UNKNOWN)
-			i->spbias += 2;
-	if (strcasecmp(op, "POP") == 0) {
-		if (i->spbias != BIAS_UNKNOWN)
-			i->spbias -= 2;
-		if (i->spbias < 0)
-			error("negative frame bias");
-	}
-	if (strcasecmp(op, "INX") == 0 && i->dr == REG_SP) {
-		if (i->spbias != BIAS_UNKNOWN)
-			i->spbias--;
+	while (p < e && isspace(*p))
+		p++;
+	for (n = p; n < e && name_char(*n); n++);
+	if (n < e && n > p && *n == ':') {
+		file_name(p, n - p, FN_DEFINED);
+		p = n + 1;
+		while (p < e && isspace(*p))
+			p++;
 	}
-	if (strcasecmp(op, "DEX") == 0 && i->dr == REG_SP) {
-		if (i->spbias != BIAS_UNKNOWN)
-			i->spbias++;
+	if (!(e - p >= 7 && strncasecmp(p, ".define", 7) == 0)
+	    && !(e - p >= 5 && strncasecmp(p, ".comm", 5) == 0))
+		return;
+	while (p < e && !isspace(*p))
+		p++;
+	while (p < e) {
+		while (p < e && (isspace(*p) || *p == ','))
+			p++;
+		for (n = p; n < e && name_char(*n); n++);
+		if (n > p)
+			file_name(p, n - p, FN_EXPORTED);
+		/* Skip anything else such as the .comm size */
+		for (p = n; p < e && *p != ','; p++);
 	}
-	/*
-	 *  This next block looks for the cases that the stack pointer is adjusted
-	 *  using LXI H,nn; DAD SP; SPHL
-	 */
-	if (strcasecmp(op, "DAD") && i->sr == REG_SP) {
-		if ((i->prev->value[REG_H] & VALUE_KNOWN) &&
-		    (i->prev->value[REG_L] & VALUE_KNOWN)) {
-			/* We are tracking a dad sp / lxi sp set */
-			i->next->flags |= HL_SPBIAS;
-			/* 16bit signed */
-			i->next->spbias = pair_value(i->prev, REG_H);
-			/* FIXME: we need to propogate this down so maybe do this
-			   logic later. It's ok for now as the DAD SPHL are paired */
+}
+
+static void scan_names(const char *p, const char *e)
+{
+	const char *s = p;
+	char q = 0;
+
+	for (; p < e; p++) {
+		if (q) {
+			if (*p == '\\')
+				p++;
+			else if (*p == q || *p == '\n')
+				q = 0;
+			continue;
+		}
+		if (*p == '\'' || *p == '"')
+			q = *p;
+		else if (*p == '!') {
+			scan_statement(s, p);
+			while (p < e && *p != '\n')
+				p++;
+			s = p + 1;
+		} else if (*p == ';' || *p == '\n') {
+			scan_statement(s, p);
+			s = p + 1;
 		}
 	}
-	if (strcasecmp(op, "SPHL") && i->dr == REG_SP
-	    && i->spbias != BIAS_UNKNOWN) {
-		if (i->prev->flags & HL_SPBIAS)
-			i->spbias += (int16_t) (i->prev->spbias & 0xFFFF);
-		else
-			i->spbias = BIAS_UNKNOWN;
-	}
+	if (s < e)
+		scan_statement(s, e);
+}
 
-	/* General operation tracking. Simple for now as we don't try to tackle
-	   flag, stack, label or memory tracking at all */
+/* Split the input into functions and optimize each in turn */
+static void optimize_text(const char *p, size_t len)
+{
+	const char *e = p + len;
 
-	for (n = REG_A; n <= REG_L; n++) {
-		if (!(i->next->set & (1 << n))) {
-			if (know_reg_value(i->prev, n)) {
-				set_reg_value(i->next, n,
-					      reg_value(i->prev, n));
-			}
-		}
+	holding = !ctx->cachedir && !ctx->debug;
+	scan_names(p, e);
+	while (p < e) {
+		const char *x = memchr(p, '\n', e - p);
+		if (x == NULL)
+			x = e;
+
+		linenum++;
+
+		while (p < x && isspace(*p))
+			p++;
+		if (function_start(p, x))
+			flush_function();
+		if (p < x)
+			parse_line(p, x - p);
+		p = x + 1;
 	}
+	flush_function();
+	write_output();
+}
 
-	/* TODO: when we know the result we should consider swapping
-	   a lot of these for loads and adjusting the prev->need so we
-	   can run a second elimination pass ? */
-	/* INC and DEC */
-	if (strcasecmp(op, "DCR") == 0 && know_reg_value(i->prev, i->dr))
-		set_reg_value(i->next, i->dr,
-			      (reg_value(i->prev, i->dr) - 1) & 0xFF);
-	if (strcasecmp(op, "INR") == 0 && know_reg_value(i->prev, i->dr))
-		set_reg_value(i->next, i->dr,
-			      (reg_value(i->prev, i->dr) + 1) & 0xFF);
-	if (strcasecmp(op, "DCX") == 0 && know_pair_value(i->prev, i->dr))
-		set_pair_value(i->next, i->dr,
-			       (pair_value(i->prev, i->dr) - 1) & 0xFFFF);
-	if (strcasecmp(op, "INX") == 0 && know_pair_value(i->prev, i->dr))
-		set_pair_value(i->next, i->dr,
-			       (pair_value(i->prev, i->dr) + 1) & 0xFFFF);
-
-	/* Logic: mostly to deal with XRA A */
-	if (strcasecmp(op, "ANA") == 0 && know_reg_value(i->prev, i->sr)
-	    && know_reg_value(i->prev, REG_A))
-		set_reg_value(i->next, i->dr,
-			      reg_value(i->prev,
-					REG_A) & reg_value(i->prev,
-							   i->sr));
-	if (strcasecmp(op, "ORA") == 0 && know_reg_value(i->prev, i->sr)
-	    && know_reg_value(i->prev, REG_A))
-		set_reg_value(i->next, i->dr,
-			      reg_value(i->prev,
-					REG_A) | reg_value(i->prev,
-							   i->sr));
-	/* XRA A is sort of special. Handle it as a mvi of 0 */
-	if (strcasecmp(op, "XRA") == 0 && i->sr == REG_A) {
-		i->prev->need &= ~REG_A;
-		set_reg_value(i->next, REG_A, 0);
-	}
-	if (strcasecmp(op, "XRA") == 0 && know_reg_value(i->prev, i->sr)
-	    && know_reg_value(i->prev, REG_A))
-		set_reg_value(i->next, i->dr,
-			      reg_value(i->prev,
-					REG_A) ^ reg_value(i->prev,
-							   i->sr));
-	/* Maths: not yet with carry tracking */
-	if (strcasecmp(op, "ADA") == 0 && know_reg_value(i->prev, i->sr)
-	    && know_reg_value(i->prev, REG_A))
-		set_reg_value(i->next, i->dr,
-			      reg_value(i->prev,
-					REG_A) + reg_value(i->prev,
-							   i->sr));
-	if (strcasecmp(op, "SBA") == 0 && know_reg_value(i->prev, i->sr)
-	    && know_reg_value(i->prev, REG_A))
-		set_reg_value(i->next, i->dr,
-			      reg_value(i->prev,
-					REG_A) - reg_value(i->prev,
-							   i->sr));
-
-	if (i->addrconst != CONST_UNKNOWN) {
-		if (strcasecmp(op, "ANI") == 0
-		    && know_reg_value(i->prev, REG_A))
-			set_reg_value(i->next, i->dr,
-				      reg_value(i->prev,
-						REG_A) & i->addrconst);
-		if (strcasecmp(op, "ORI") == 0
-		    && know_reg_value(i->prev, REG_A))
-			set_reg_value(i->next, i->dr,
-				      reg_value(i->prev,
-						REG_A) | i->addrconst);
-		if (strcasecmp(op, "XRI") == 0
-		    && know_reg_value(i->prev, REG_A))
-			set_reg_value(i->next, i->dr,
-				      reg_value(i->prev,
-						REG_A) ^ i->addrconst);
-		if (strcasecmp(op, "ADI") == 0
-		    && know_reg_value(i->prev, REG_A))
-			set_reg_value(i->next, i->dr,
-				      reg_value(i->prev,
-						REG_A) + i->addrconst);
-		if (strcasecmp(op, "SUI") == 0
-		    && know_reg_value(i->prev, REG_A))
-			set_reg_value(i->next, i->dr,
-				      reg_value(i->prev,
-						REG_A) - i->addrconst);
-	}
-	/* 16bit add */
-	if (strcasecmp(op, "DAD") == 0 && know_pair_value(i->prev, REG_H)
-	    && know_pair_value(i->prev, i->sr))
-		set_pair_value(i->next, REG_H,
-			       pair_value(i->prev,
-					  REG_H) + pair_value(i->prev,
-							      i->sr));
-	/* Might be worth doing rotates and complement FIXME */
+static void optimize_file(FILE *fp)
+{
+	size_t len;
+	const char *p = read_input(fp, &len);
+	optimize_text(p, len);
 }
 
-static void compute_values(void)
+/*
+ *	The library interface. A context holds the options and rules of one
+ *	user. The IR, arena and tables are working state kept per thread, so
+ *	each thread runs its own calls and a context may move between threads
+ *	but not be used by two at once. A failure unwinds to the call that
+ *	started the work and leaves the reason in the context.
+ */
+/* Each call starts with a setjmp for fail() to come back to. Anything
+   the failed run left half done is put right before the caller sees the
+   error */
+static int abandon(struct opt85 *c)
 {
-	struct instruction *i = codehead;
-	/* e tracks the previous live registers known, as we need to
-	   ignore any dead stuff when we copy them through */
-	while (i) {
-		int n;
-		compute_effects(i);
-		/* We assume everything at a label is unknown because we can't know
-		   the callers */
-		if (i->label == NULL) {
-			/* Propagate known values */
-			for (n = REG_A; n <= REG_L; n++) {
-				if (!(i->next->set & (1 << n))) {
-					if (know_reg_value(i->prev, n))
-						set_reg_value(i->next, n, reg_value(i->prev, n));
-				}
-				/* Worth debug checks here if i->next->set is clear but value
-				   already known as it shouldn't happen ?? */
-			}
-		}
-		i = i->next->next;
+	if (c->rulefp) {
+		fclose(c->rulefp);
+		c->rulefp = NULL;
+	}
+	if (c->cachefp) {
+		fclose(c->cachefp);
+		unlink(c->cachetmp);
+		c->cachefp = NULL;
+		c->cachetmp = NULL;
 	}
+	c->textlen = 0;
+	reset_state();
+	return -1;
 }
 
-static void make_op(struct instruction *i, const char *m)
+struct opt85 *opt85_new(void)
 {
-	char *p = zalloc(8);
-	sprintf(p, "%s %c,%c", m, regname(i->dr), regname(i->sr));
-	i->op = p;
-	i->opcode = m;
-	i->opinfo = find_operation(m);
+	struct opt85 *c = calloc(1, sizeof(struct opt85));
+	if (c == NULL)
+		return NULL;
+	c->rulehash = calloc(RULEHASH_SIZE, sizeof(struct rule *));
+	if (c->rulehash == NULL) {
+		free(c);
+		return NULL;
+	}
+	init_ops();
+	c->cost_bytes = 4;
+	c->cost_cycles = 1;
+	c->rulesum = 0xCBF29CE484222325ULL;
+	c->out = stdout;
+	set_target(c, "8080");
+	return c;
 }
 
-static void make_op1(struct instruction *i, const char *m)
+void opt85_free(struct opt85 *c)
 {
-	char *p = zalloc(8);
-	sprintf(p, "%s %c", m, regname(i->dr));
-	i->op = p;
-	i->opcode = m;
-	i->opinfo = find_operation(m);
+	unsigned int i;
+	struct rule *r;
+
+	if (c == NULL)
+		return;
+	for (i = 0; i < RULEHASH_SIZE; i++) {
+		while ((r = c->rulehash[i]) != NULL) {
+			c->rulehash[i] = r->next;
+			free(r);
+		}
+	}
+	if (ctx == c)
+		ctx = NULL;
+	free(c->rulehash);
+	free(c->cachedir);
+	free(c->text);
+	free(c);
 }
 
-static void make_op2_r(struct instruction *i, const char *m, int rd, int rs)
+const char *opt85_error(struct opt85 *c)
 {
-	char *p = zalloc(8);
-	sprintf(p, "%s %c,%c", m, regname(rd), regname(rs));
-	i->op = p;
-	i->opcode = m;
-	i->opinfo = find_operation(m);
+	return c->err;
 }
 
-/* The caller is responsible for fixing up the register values resulting
-   in any split: see adjust_immed16() */
-static struct instruction *add_op1(struct instruction *i, const char *m)
+/* Options are the command line ones by name. The rules are loaded
+   straight away and add to any already loaded */
+int opt85_set(struct opt85 *c, const char *opt, const char *value)
 {
-	struct instruction *n = append_instruction(i);
-	make_op1(n, m);
-	compute_effects(i);
-	compute_effects(n);
-	i->next->need = i->prev->need & ~i->next->set;
-	n->next->need = n->prev->need & ~n->next->set;
-	return n;
+	ctx = c;
+	init_ops();
+	if (setjmp(c->fail))
+		return abandon(c);
+	if (strcmp(opt, "cpu") == 0) {
+		if (!set_target(c, value))
+			fail("unknown cpu '%s'.", value);
+	} else if (strcmp(opt, "O") == 0) {
+		/* Size first or speed first, the other breaks ties */
+		if (strcmp(value, "s") == 0) {
+			c->cost_bytes = 256;
+			c->cost_cycles = 1;
+		} else if (strcmp(value, "t") == 0) {
+			c->cost_bytes = 1;
+			c->cost_cycles = 256;
+		} else
+			fail("unknown optimization '-O%s'.", value);
+	} else if (strcmp(opt, "debug") == 0)
+		c->debug = value && atoi(value);
+	else if (strcmp(opt, "cache") == 0) {
+		free(c->cachedir);
+		c->cachedir = NULL;
+		if (value == NULL)
+			return 0;
+		if (mkdir(value, 0777) == -1 && errno != EEXIST)
+			fail("%s: %s", value, strerror(errno));
+		c->cachedir = strdup(value);
+		if (c->cachedir == NULL)
+			fail("Out of memory.");
+	} else if (strcmp(opt, "rules") == 0) {
+		reset_state();
+		load_rules(value);
+	} else
+		fail("unknown option '%s'.", opt);
+	return 0;
 }
 
-static struct instruction * add_op2_r(struct instruction *i, const char *m, int rd, int rs)
+/* Add to the text for the next run. The IR points into the text so we
+   keep our own copy */
+int opt85_feed(struct opt85 *c, const char *text, size_t len)
 {
-	struct instruction *n = append_instruction(i);
-	make_op2_r(n, m, rd, rs);
-	compute_effects(i);
-	compute_effects(n);
-	i->next->need = i->prev->need & ~i->next->set;
-	n->next->need = n->prev->need & ~n->next->set;
-	return n;
+	ctx = c;
+	init_ops();
+	if (setjmp(c->fail))
+		return abandon(c);
+	if (c->textlen + len > c->textsize) {
+		char *p;
+		c->textsize = c->textlen + len + READ_BLOCK;
+		p = realloc(c->text, c->textsize);
+		if (p == NULL)
+			fail("Out of memory.");
+		c->text = p;
+	}
+	memcpy(c->text + c->textlen, text, len);
+	c->textlen += len;
+	return 0;
 }
 
-static void eliminate_instruction(struct instruction *i)
+/* Optimize the text fed so far as one file */
+int opt85_run(struct opt85 *c, FILE *out)
 {
-	struct instruction *p;
+	ctx = c;
+	init_ops();
+	if (setjmp(c->fail))
+		return abandon(c);
+	c->out = out;
+	reset_state();
+	optimize_text(c->text, c->textlen);
+	c->textlen = 0;
+	reset_state();
+	return 0;
+}
 
-	printf("Eliminate %p %p\n", (void *)i, (void *)i->prev->prev);
-	/* Find the previous live instruction */
-	p = i->prev->prev;
+/* As opt85_run but the result comes back in memory the caller frees */
+int opt85_text(struct opt85 *c, char **text, size_t *len)
+{
+	FILE *fp = open_memstream(text, len);
+	int r;
 
-	/* Unlink ourself but keep our own pointers valid */
-	if (p) {
-		p->next->next = i->next->next;
-		i->next->next->prev = p->next;
-	} else {
-		i->next->next->prev = &dummy_effect;
+	if (fp == NULL) {
+		snprintf(c->err, sizeof(c->err), "%s", strerror(errno));
+		return -1;
+	}
+	r = opt85_run(c, fp);
+	if (fclose(fp) && r == 0) {
+		snprintf(c->err, sizeof(c->err), "%s", strerror(errno));
+		r = -1;
+	}
+	if (r) {
+		free(*text);
+		*text = NULL;
+		*len = 0;
 	}
-	if (codehead == i)
-		codehead = i->next->next;
+	return r;
+}
 
-	
-	printf("Eliminating %s\n", i->op);
-	i->set = 0;
-	i->dead = 1;
-	i->prev->need = i->next->need;
+int opt85_file(struct opt85 *c, FILE *in, FILE *out)
+{
+	ctx = c;
+	init_ops();
+	if (setjmp(c->fail))
+		return abandon(c);
+	c->out = out;
+	reset_state();
+	optimize_file(in);
+	reset_state();
+	return 0;
+}
 
-#if 0
-	/* We are dead, so any values we know are the values our predecessor
-	   knew because we changed nothing - unless they knew because we set
-	   them */
-	for (n = REG_A; n <= REG_L; n++) {
-		if (know_reg_value(p->next, n) && !(i->next->set & (1 << n))) {
-			set_reg_value(i->next, n, reg_value(i->prev, n));
-		} else {
-			clear_reg_value(i->next, n);
-		}
-	}
-#endif	
-	/* We are now a do nothing */
-	i->next->set = 0;
+/* Search for rules of up to len instructions and write them to out */
+int opt85_superoptimize(struct opt85 *c, unsigned int len, FILE *out)
+{
+	ctx = c;
+	init_ops();
+	if (setjmp(c->fail))
+		return abandon(c);
+	c->out = out;
+	reset_state();
+	superoptimize(len);
+	return 0;
 }
 
-/* We should do this for all the 8bit immediates. We don't bother looking
-   for mov a,0 because the compiler is smart enough already */
-static void adjust_immed8(void)
+/* The memory the calling thread kept for its next run */
+void opt85_release(void)
 {
-	struct instruction *i = codehead;
-	int r;
-	while (i) {
-		int kdr = know_reg_value(i->prev, i->dr);
-		/* Remove anybody who loads a preloaded value */
-		/* Use icr/dcr otherwise - should be safe but needs review
-		   of compiler rules. We might need to flag this with
-		   a PSW check but I don't think ack generates delayed
-		   conditionals this way */
-		if ((i->opinfo->flags & OP_MVI) && kdr) {
-			uint8_t v = reg_value(i->prev, i->dr);
-			if (v == (uint8_t)i->addrconst)
-				eliminate_instruction(i);
-			else if (v == (uint8_t)(i->addrconst + 1))
-				make_op1(i, "DCR");
-			else if (v == (uint8_t)(i->addrconst - 1))
-				make_op1(i, "INR");
-		}
-		if (i->opinfo->flags & OP_MOV) {
-			if (know_reg_value(i->prev, i->dr) &&
-			    know_reg_value(i->prev, i->sr) && 
-				reg_value(i->prev, i->dr) == reg_value(i->prev, i->sr)) {
-				eliminate_instruction(i);
-			}
-		}
-		/* For each 8bit operation with an immediate source look to see if
-		   we can find the value lurking in a register. For 0, 1 and 255 at
-		   least it's got a fair chance of being there somewhere */
-		else if (((i->opinfo->flags & (OP_IMMED | OP_AOP)) ==
-		     (OP_IMMED | OP_AOP)) || (i->opinfo->flags & OP_MVI)) {
-//			printf("Candidate %s want %d\n", i->op,
-//			       i->addrconst);
-			r = find_reg_value(i->prev, i->addrconst);
-			if (r) {
-				i->sr = r;
-				/* Convert to normal op from immediate */
-				i->opinfo--;
-				make_op(i, i->opinfo->op);
-			}
+	release_memory();
+}
+
+#ifndef OPT85_LIB
+
+/*
+ *	Batch mode. Each job is an input and output file. The jobs are shared
+ *	out between the workers, each of which works through its list reusing
+ *	the same arena and tables.
+ */
+struct job {
+	const char *in;
+	const char *out;
+};
+
+static struct job *jobs;
+static unsigned int njobs, jobsize;
+
+static void add_job(const char *in, const char *out)
+{
+	if (njobs == jobsize) {
+		jobsize = jobsize ? jobsize * 2 : 32;
+		jobs = realloc(jobs, jobsize * sizeof(struct job));
+		if (jobs == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
 		}
-		i = i->next->next;
 	}
+	jobs[njobs].in = in;
+	jobs[njobs].out = out;
+	njobs++;
 }
 
-/* For 16bit we really need labels sorted so we can spot label relative
-   inx/dex for fixup and 16bit duplicates. For now we can only do numeric
-   constants */
-static void adjust_immed16(void)
+/* A response file holds one "input output" pair per line. Names can be
+   any length but may not contain spaces */
+static void load_response(const char *name)
 {
-	struct instruction *i = codehead;
-	struct instruction *n;
-	while (i) {
-		int kdr = know_pair_value(i->prev, i->dr);
-		/* Optimise LXI if we can */
-		if (strcasecmp(i->opcode, "LXI") == 0 && i->addrconst != CONST_UNKNOWN ) {
-			uint16_t v;
-			if (kdr)
-				v = reg_value(i->prev, i->dr);
+	FILE *fp = fopen(name, "r");
+	char *buf = NULL;
+	size_t size = 0;
+	unsigned int line = 0;
 
-			if (kdr && v == (uint8_t)i->addrconst)
-				eliminate_instruction(i);
-			else if (kdr && v == (uint16_t)(i->addrconst + 1))
-				make_op1(i, "DEX");
-			else if (kdr && v == (uint16_t)(i->addrconst - 1))
-				make_op1(i, "INX");
-			else if (kdr && v == (uint16_t)(i->addrconst + 2)) {
-				make_op1(i, "DEX");
-				set_pair_value(i->next, REG_H, pair_value(i->prev, REG_H) - 1);
-				n = add_op1(i, "DEX");
-				set_pair_value(n->next, REG_H, pair_value(i->prev, REG_H) - 1);
-			} else if (kdr && v == (uint16_t)(i->addrconst - 2)) {
-				make_op1(i, "INX");
-				set_pair_value(i->next, REG_H, pair_value(i->prev, REG_H) + 1);
-				n = add_op1(i, "INX");
-				set_pair_value(n->next, REG_H, pair_value(i->prev, REG_H) + 1);
-			} else {
-				/* Look for our register values in a pair of others.
-				   It's only a win if they are both present and we are
-				   not exchanging halves with ourself */
-				int rl = find_reg_value(i->prev, i->addrconst & 0xFF);
-				int rh = find_reg_value(i->prev, i->addrconst >> 8);
-				/* We get in a mess if we want to load de from ed */
-				if (rl && rh && !(rl == i->dr && rh == i->dr + 1)) {
-					/* If the low part is in the register
-					   we are setting up do it first */
-					if (rl == i->dr || rl == i->dr + 1) {
-						make_op2_r(i, "MOV", i->dr+1, rl);
-						set_reg_value(i->next, i->dr+1, i->addrconst & 0xFF);
-						clear_reg_value(i->next, i->dr);
-						n = add_op2_r(i, "MOV", i->dr, rh);
-						set_pair_value(n->next, i->dr, i->addrconst);
-					} else {
-						make_op2_r(i, "MOV", i->dr, rh);
-						n = add_op2_r(i, "MOV", i->dr+1, rl);
-						set_reg_value(i->next, i->dr+1, i->addrconst & 0xFF);
-						clear_reg_value(i->next, i->dr);
-						set_pair_value(n->next, i->dr, i->addrconst);
-					}
-				}
-			}
+	if (fp == NULL) {
+		perror(name);
+		exit(1);
+	}
+	while (getline(&buf, &size, fp) != -1) {
+		char *in = strtok(buf, " \t\r\n");
+		char *out = strtok(NULL, " \t\r\n");
+
+		line++;
+		if (in == NULL || *in == '#')
+			continue;
+		if (out == NULL || strtok(NULL, " \t\r\n")) {
+			fprintf(stderr, "%s:%u: expected input and output file.\n",
+				name, line);
+			exit(1);
 		}
-		else if (strcasecmp(i->opcode, "DAD") == 0 && know_pair_value(i->prev, i->sr)) {
-			/* Not much to say here. At this level we don't
-			   eliminate constant maths but we can fix up
-			   DAD to INX and DEX */
-			uint16_t v = pair_value(i->prev, i->sr);
-			/* Need to review these for flags */
-			if (!(i->next->need & REG_PSW)) {
-				if (v == 0)
-					eliminate_instruction(i);
-				if (v == 1)
-					make_op1(i, "INX");
-				if (v == -1)
-					make_op1(i, "DEX");
-				if (v == 2) {
-					make_op1(i, "INX");
-					set_pair_value(i->next, REG_H, pair_value(i->prev, REG_H) + 1);
-					n = add_op1(i, "INX");
-					set_pair_value(n->next, REG_H, pair_value(i->prev, REG_H) + 1);
-				}
-				if (v == -2) {
-					make_op1(i, "DEX");
-					set_pair_value(i->next, REG_H, pair_value(i->prev, REG_H) - 1);
-					n = add_op1(i, "DEX");
-					set_pair_value(n->next, REG_H, pair_value(i->prev, REG_H) - 1);
-				}
-			}
+		in = strdup(in);
+		out = strdup(out);
+		if (in == NULL || out == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
 		}
-		i = i->next->next;
+		add_job(in, out);
+	}
+	if (ferror(fp)) {
+		perror(name);
+		exit(1);
 	}
+	free(buf);
+	fclose(fp);
 }
 
+static struct opt85 *opts;
 
-/* We walk backwards to propagate need values. A need is copied back until
-   a set for it is found. We have some artificial needs on call/ret etc so
-   that we don't optimize out stuff like return values
-   
-   A value is needed if it was needed by the instruction after and not
-   set by this one. It may still be needed even if set because the set may be
-   an operation depending upon it (eg inr a) */
-
-static void propagate_need(void)
+static int run_job(struct job *j)
 {
-	struct instruction *i = codetail;
+	FILE *in = fopen(j->in, "r");
+	FILE *out;
+	int err;
 
-	while (i) {
-		/* Can we eliminate the instruction we are considering ? */
-		/* If it has no side effects and we don't need any of its outputs
-		   kill it off */
-		if (!(i->next->need & i->next->set)
-		    && !(i->next->set & KEEPMASK))
-			eliminate_instruction(i);
-		else {
-			/* If not propagate the requirements it had */
-//			printf("%s: need was %x now ", i->op,
-//			       i->prev->need);
-			i->prev->need |= i->next->need & ~i->next->set;
-//			printf("%x\n", i->prev->need);
-		}
-		i = i->prev->prev;
+	if (in == NULL) {
+		perror(j->in);
+		return 1;
+	}
+	out = fopen(j->out, "w");
+	if (out == NULL) {
+		perror(j->out);
+		fclose(in);
+		return 1;
+	}
+	err = opt85_file(opts, in, out);
+	if (err)
+		fprintf(stderr, "%s: %s\n", j->in, opt85_error(opts));
+	fclose(in);
+	if (fclose(out)) {
+		perror(j->out);
+		err = 1;
 	}
+	return err != 0;
 }
 
+static int run_worker(unsigned int w, unsigned int workers)
+{
+	unsigned int n;
+	int err = 0;
+	for (n = w; n < njobs; n += workers)
+		err |= run_job(jobs + n);
+	return err;
+}
 
-
-/* FIXME: parse ; as statement separator */
-static void parse_line(char *p)
+static int run_batch(unsigned int workers)
 {
-	struct instruction *i;
-	struct label *l;
+	unsigned int w;
+	int err = 0;
+	int status;
 
-	char *x = strchr(p, '!');
-	char *lab = NULL;
-	/* Strip comment */
-	if (x)
-		*x = 0;
-	x = p;
-	/* Look for a label */
-	while (*x && *x != '\'' && *x != '\"') {
-		if (*x == ':') {
-			*x++ = 0;
-			lab = p;
-			p = x;
-			break;
+	if (workers > njobs)
+		workers = njobs;
+	if (workers <= 1)
+		return run_worker(0, 1);
+
+	fflush(stdout);
+	for (w = 0; w < workers; w++) {
+		pid_t pid = fork();
+		if (pid == -1) {
+			perror("fork");
+			exit(1);
 		}
-		x++;
+		if (pid == 0)
+			exit(run_worker(w, workers));
 	}
-	/* Now deal with the post label stuff */
-	x = p;
-	while (*x && isspace(*x))
-		x++;
-
-	/* FIXME: support label only lines */
-	if (*x == 0 && !lab)
-		return;
+	while (wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			err = 1;
+	return err;
+}
 
-	i = new_instruction();
-	i->op = x;
-	if (lab) {
-		l = new_label();
-		l->name = lab;
-		l->next = NULL;
-		l->instruction = i;
-		i->label = l;
-		/* TODO: for now take the simple approach - any label invalidates
-		   all known values. We can improve on this later */
-		invalidate_regs(i->prev);
-	}
-	parse_instruction(i);
+static void usage(void)
+{
+	fprintf(stderr, "opt85 [-d] [-Os|-Ot] [--cpu=8080|8085|z80] [-C cachedir]\n"
+			"      [-r rules] [-j workers] [-f responsefile]\n"
+			"      [input output]...\n"
+			"opt85 [--cpu=8080|8085|z80] -S length\n");
+	exit(1);
 }
 
-/* Debug for now asm output eventually */
-static void dump_output(void)
+/* Apply an option, an error in one is the end of the run */
+static void set_option(const char *opt, const char *value)
 {
-	struct instruction *i = codehead;
-	while (i) {
-		if (i->dead)
-			printf("---- BEGIN DEAD ----\n");
-		print_regmap(i->prev->need);
-		printf("\n");
-		if (i->label)
-			printf("%s:", i->label->name);
-		printf("%s\n", i->op);
-		print_regmap(i->next->set);
-		printf("\n");
-		print_values(i->next);
-		printf("\n");
-
-		if (i->dead)
-			printf("----  END DEAD  ----\n");
-		
-		i = i->next->next;
+	if (opt85_set(opts, opt, value)) {
+		fprintf(stderr, "opt85: %s\n", opt85_error(opts));
+		exit(1);
 	}
 }
 
-static void load_file(FILE * fp)
+int main(int argc, char *argv[])
 {
-	char buf[512];
+	static const struct option longopts[] = {
+		{ "cpu", required_argument, NULL, 'm' },
+		{ NULL, }
+	};
+	unsigned int workers = 1;
+	const char *target = "8080";
+	const char *rules = NULL;
+	int solen = 0;
+	int opt;
 
-	while (fgets(buf, 511, stdin)) {
-		char *p = buf;
-		char *x;
+	opts = opt85_new();
+	if (opts == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
 
-		linenum++;
+	while ((opt = getopt_long(argc, argv, "dj:f:O:C:r:S:", longopts,
+				  NULL)) != -1) {
+		switch (opt) {
+		case 'm':
+			target = optarg;
+			break;
+		case 'd':
+			set_option("debug", "1");
+			break;
+		case 'S':
+			solen = atoi(optarg);
+			break;
+		case 'r':
+			rules = optarg;
+			break;
+		case 'C':
+			set_option("cache", optarg);
+			break;
+		case 'O':
+			if (strcmp(optarg, "s") && strcmp(optarg, "t"))
+				usage();
+			set_option("O", optarg);
+			break;
+		case 'j':
+			workers = atoi(optarg);
+			if (workers < 1)
+				usage();
+			break;
+		case 'f':
+			load_response(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	/* The target sets the costs everything else is worked out with */
+	if (opt85_set(opts, "cpu", target))
+		usage();
+	if (solen) {
+		if (opt85_superoptimize(opts, solen, stdout)) {
+			fprintf(stderr, "opt85: %s\n", opt85_error(opts));
+			exit(1);
+		}
+		return 0;
+	}
+	if (rules)
+		set_option("rules", rules);
+	if ((argc - optind) & 1)
+		usage();
+	while (optind < argc) {
+		add_job(argv[optind], argv[optind + 1]);
+		optind += 2;
+	}
 
-		while (*p && isspace(*p))
-			p++;
-		if (*p == 0)
-			continue;
-		x = strchr(p, '\n');
-		if (x)
-			*x = 0;
-		p = strdup(p);
-		if (p == NULL) {
-			fprintf(stderr, "Out of memory.\n");
+	/* Classic filter mode */
+	if (njobs == 0) {
+		if (opt85_file(opts, stdin, stdout)) {
+			fprintf(stderr, "%s\n", opt85_error(opts));
 			exit(1);
 		}
-		parse_line(p);
+		return 0;
 	}
+	return run_batch(workers);
 }
 
-int main(int argc, char *argv[])
-{
-	load_file(stdin);
-	/* Join all the labels together */
-	/* TODO link_labels(); */
-	/* Set the need flags so we can do unused elimination */
-	printf("Propagate:\n");
-	propagate_need();
-	/* Simple constant propagation */
-	printf("Values:\n");
-	compute_values();
-	/* Constant loads to register for 8bit operations */
-	printf("Immed8:\n");
-	adjust_immed8();
-	printf("Immed16:\n");
-	adjust_immed16();
-	/* Look for assignments we can move about and make into pair loads */
-	/* TODO move_assignments(); */
-	/* Check our fp/sp biasing model is consistent */
-	/* TODO validate_spbias(); */
-	/* Replace the 8080 helpers with ldsi/lhlx */
-	/* TODO eliminate_helpers(); */
-	/* Look for cases we can use ldhi ? */
-	printf("Dump:\n");
-	dump_output();
-	return 0;
-}
+#endif
@@ -0,0 +1,40 @@
+#ifndef _OPT85_H
+#define _OPT85_H
+
+#include <stdio.h>
+
+/*
+ *	opt85 as a library. Build opt85.c with -DOPT85_LIB to leave out the
+ *	command line tool. Each call returns 0, or -1 with the reason in
+ *	opt85_error().
+ *
+ *	A context holds the options, the rules and any text fed to it. The
+ *	IR, the memory arena and the symbol and output tables belong to the
+ *	thread making the call, so threads may run at the same time as long
+ *	as each uses its own context. A context can move between threads but
+ *	must not be in two calls at once.
+ */
+struct opt85;
+
+extern struct opt85 *opt85_new(void);
+extern void opt85_free(struct opt85 *c);
+extern const char *opt85_error(struct opt85 *c);
+
+/* "cpu" (8080, 8085, z80), "O" (s or t), "debug" (0 or 1), "cache"
+   (a directory, NULL for none) and "rules" (a table to add) */
+extern int opt85_set(struct opt85 *c, const char *opt, const char *value);
+
+/* Text fed is kept until opt85_run optimizes it as one file */
+extern int opt85_feed(struct opt85 *c, const char *text, size_t len);
+extern int opt85_run(struct opt85 *c, FILE *out);
+/* The same but the result is returned in *text, which the caller frees */
+extern int opt85_text(struct opt85 *c, char **text, size_t *len);
+
+extern int opt85_file(struct opt85 *c, FILE *in, FILE *out);
+extern int opt85_superoptimize(struct opt85 *c, unsigned int len, FILE *out);
+
+/* Free the memory the calling thread keeps between runs, for example
+   before it exits */
+extern void opt85_release(void);
+
+#endif